@@ -0,0 +1,199 @@
+/**
+* This file is part of ORB-SLAM2.
+*
+* Copyright (C) 2014-2016 RaYl Mur-Artal <raulmur at unizar dot es> (University of Zaragoza)
+* For more information see <https://github.com/raulmur/ORB_SLAM2>
+*
+* ORB-SLAM2 is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* ORB-SLAM2 is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with ORB-SLAM2. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Times the FAST detection of the ORB extractor on an image pyramid, single threaded:
+// the per-level scoring (ComputeFASTScores + FASTNonMaxSuppression per cell) against
+// the previous path, which ran cv::FAST on each cell at iniThFAST, then at minThFAST if it found nothing.
+//
+// Usage: ./fast_benchmark [image ...]
+// Without images, random textured images of the KITTI (1241x376) and EuRoC (752x480) sizes are used.
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+#include <cmath>
+
+#include <opencv2/opencv.hpp>
+
+#include "FAST.h"
+
+using namespace ORB_SLAM2;
+
+// Same settings as the example configurations and the extractor
+static const int NLEVELS = 8;
+static const float SCALE_FACTOR = 1.2f;
+static const int INI_TH_FAST = 20;
+static const int MIN_TH_FAST = 7;
+static const int EDGE_THRESHOLD = 19;
+static const int CELL_SIZE = 30;
+static const int FAST_RADIUS = 3;
+static const int DIAMETER = 2 * FAST_RADIUS;
+static const int NREPEATS = 50;
+
+struct Grid
+{
+	Grid(const cv::Rect& roi) : roi(roi)
+	{
+		gridw = std::max(roi.width / CELL_SIZE, 1);
+		gridh = std::max(roi.height / CELL_SIZE, 1);
+		cellw = static_cast<int>(std::ceil(1. * roi.width / gridw));
+		cellh = static_cast<int>(std::ceil(1. * roi.height / gridh));
+	}
+
+	// Calls func(x0, y0, x1, y1) for the area of each cell, the FAST border included
+	template <class Func>
+	void ForEachCell(Func func) const
+	{
+		const int maxx = roi.x + roi.width;
+		const int maxy = roi.y + roi.height;
+		for (int cy = 0, y0 = roi.y; cy < gridh && y0 + DIAMETER < maxy; cy++, y0 += cellh)
+		{
+			const int y1 = std::min(y0 + cellh + DIAMETER, maxy);
+			for (int cx = 0, x0 = roi.x; cx < gridw && x0 + DIAMETER < maxx; cx++, x0 += cellw)
+				func(x0, y0, std::min(x0 + cellw + DIAMETER, maxx), y1);
+		}
+	}
+
+	cv::Rect roi;
+	int gridw, gridh, cellw, cellh;
+};
+
+static cv::Rect DetectionArea(const cv::Mat& image)
+{
+	const int border = EDGE_THRESHOLD - FAST_RADIUS;
+	return cv::Rect(border, border, image.cols - 2 * border, image.rows - 2 * border);
+}
+
+// The previous path: cv::FAST on each cell, run again at minThFAST on the cells without corners
+static size_t DetectPerCell(const std::vector<cv::Mat>& pyramid)
+{
+	size_t ncorners = 0;
+	KeyPoints keypoints;
+	for (const cv::Mat& image : pyramid)
+	{
+		Grid(DetectionArea(image)).ForEachCell([&](int x0, int y0, int x1, int y1)
+		{
+			const cv::Mat cell = image(cv::Range(y0, y1), cv::Range(x0, x1));
+			cv::FAST(cell, keypoints, INI_TH_FAST, true);
+			if (keypoints.empty())
+				cv::FAST(cell, keypoints, MIN_TH_FAST, true);
+			ncorners += keypoints.size();
+		});
+	}
+	return ncorners;
+}
+
+// The current path: each level scored once at minThFAST, the cells select their corners from the scores
+static size_t DetectWithScores(const std::vector<cv::Mat>& pyramid, std::vector<cv::Mat>& scores)
+{
+	size_t ncorners = 0;
+	KeyPoints keypoints;
+	for (size_t level = 0; level < pyramid.size(); level++)
+	{
+		const cv::Mat& image = pyramid[level];
+		const cv::Rect area = DetectionArea(image);
+		const cv::Rect scoreRect(area.x + FAST_RADIUS, area.y + FAST_RADIUS, area.width - DIAMETER, area.height - DIAMETER);
+		ComputeFASTScores(image, scoreRect, MIN_TH_FAST, scores[level]);
+
+		Grid(area).ForEachCell([&](int x0, int y0, int x1, int y1)
+		{
+			keypoints.clear();
+			const cv::Rect cell(x0 + FAST_RADIUS, y0 + FAST_RADIUS, x1 - x0 - DIAMETER, y1 - y0 - DIAMETER);
+			FASTNonMaxSuppression(scores[level], cell, MIN_TH_FAST, keypoints);
+
+			const auto isStrong = [](const cv::KeyPoint& keypoint) { return keypoint.response >= INI_TH_FAST; };
+			const size_t nstrong = std::count_if(std::begin(keypoints), std::end(keypoints), isStrong);
+			ncorners += nstrong > 0 ? nstrong : keypoints.size();
+		});
+	}
+	return ncorners;
+}
+
+template <class Func>
+static double MeanMs(Func func)
+{
+	func(); // warm up
+	const auto t0 = std::chrono::steady_clock::now();
+	for (int i = 0; i < NREPEATS; i++)
+		func();
+	const auto t1 = std::chrono::steady_clock::now();
+	return std::chrono::duration_cast<std::chrono::duration<double, std::milli>>(t1 - t0).count() / NREPEATS;
+}
+
+static void Benchmark(const std::string& name, const cv::Mat& image)
+{
+	std::vector<cv::Mat> pyramid(NLEVELS);
+	std::vector<cv::Mat> scores(NLEVELS);
+	pyramid[0] = image;
+	for (int level = 1; level < NLEVELS; level++)
+	{
+		const double scale = std::pow(SCALE_FACTOR, level);
+		const cv::Size size(cvRound(image.cols / scale), cvRound(image.rows / scale));
+		cv::resize(pyramid[level - 1], pyramid[level], size, 0, 0, cv::INTER_LINEAR);
+	}
+	for (int level = 0; level < NLEVELS; level++)
+		scores[level] = cv::Mat::zeros(pyramid[level].size(), CV_8U);
+
+	size_t ncornersPerCell = 0, ncornersScores = 0;
+	const double msPerCell = MeanMs([&]() { ncornersPerCell = DetectPerCell(pyramid); });
+	const double msScores = MeanMs([&]() { ncornersScores = DetectWithScores(pyramid, scores); });
+
+	std::cout << name << " (" << image.cols << "x" << image.rows << ", " << NLEVELS << " levels)" << std::endl;
+	std::cout << std::fixed << std::setprecision(3);
+	std::cout << "  cv::FAST per cell:           " << msPerCell << " ms, " << ncornersPerCell << " corners" << std::endl;
+	std::cout << "  scores + non-max suppression: " << msScores << " ms, " << ncornersScores << " corners" << std::endl;
+	std::cout << "  speedup: " << std::setprecision(2) << msPerCell / msScores << "x" << std::endl;
+}
+
+static cv::Mat RandomTexture(int width, int height)
+{
+	cv::Mat image(height, width, CV_8U);
+	cv::randu(image, cv::Scalar(0), cv::Scalar(256));
+	cv::GaussianBlur(image, image, cv::Size(0, 0), 1.5);
+	return image;
+}
+
+int main(int argc, char** argv)
+{
+	cv::setNumThreads(1);
+
+	if (argc < 2)
+	{
+		Benchmark("KITTI size", RandomTexture(1241, 376));
+		Benchmark("EuRoC size", RandomTexture(752, 480));
+		return 0;
+	}
+
+	for (int i = 1; i < argc; i++)
+	{
+		const cv::Mat image = cv::imread(argv[i], cv::IMREAD_GRAYSCALE);
+		if (image.empty())
+		{
+			std::cerr << "Failed to load image at: " << argv[i] << std::endl;
+			return 1;
+		}
+		Benchmark(argv[i], image);
+	}
+
+	return 0;
+}
@@ -0,0 +1,157 @@
+/**
+* This file is part of ORB-SLAM2.
+*
+* Copyright (C) 2014-2016 RaYl Mur-Artal <raulmur at unizar dot es> (University of Zaragoza)
+* For more information see <https://github.com/raulmur/ORB_SLAM2>
+*
+* ORB-SLAM2 is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* ORB-SLAM2 is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with ORB-SLAM2. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Times StereoMatcher::Compute on a stereo pair, single threaded, with the KITTI settings.
+// stereo_benchmark evaluates the sub-pixel SAD sweep with SIMD. stereo_benchmark_scalar is the same program
+// built with SCALAR_PATCH_DISTANCE, which makes the matcher use the scalar PatchDistance for each shift.
+//
+// Usage: ./stereo_benchmark [left_image right_image]
+// Without images, a random texture of the KITTI size (1241x376) and its copy shifted by a disparity
+// growing from the top to the bottom rows are used.
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+
+#include <opencv2/opencv.hpp>
+
+#include "ORBextractor.h"
+#include "ORBmatcher.h"
+#include "CameraParameters.h"
+
+using namespace ORB_SLAM2;
+
+// Same settings as Examples/Stereo/KITTI00-02.yaml
+static const int NFEATURES = 2000;
+static const float SCALE_FACTOR = 1.2f;
+static const int NLEVELS = 8;
+static const int INI_TH_FAST = 20;
+static const int MIN_TH_FAST = 7;
+static const float FX = 718.856f;
+static const float BF = 386.1448f;
+
+static const float MIN_DISPARITY = 5.f;
+static const float MAX_DISPARITY = 60.f;
+static const int NREPEATS = 100;
+
+template <class Func>
+static double MeanMs(Func func)
+{
+	func(); // warm up
+	const auto t0 = std::chrono::steady_clock::now();
+	for (int i = 0; i < NREPEATS; i++)
+		func();
+	const auto t1 = std::chrono::steady_clock::now();
+	return std::chrono::duration_cast<std::chrono::duration<double, std::milli>>(t1 - t0).count() / NREPEATS;
+}
+
+static void Benchmark(const std::string& name, const cv::Mat& imageL, const cv::Mat& imageR)
+{
+	const ORBextractor::Parameters param(NFEATURES, SCALE_FACTOR, NLEVELS, INI_TH_FAST, MIN_TH_FAST);
+	ORBextractor extractorL(param), extractorR(param);
+
+	KeyPoints keypointsL, keypointsR;
+	cv::Mat descriptorsL, descriptorsR;
+	extractorL.Extract(imageL, keypointsL, descriptorsL);
+	extractorR.Extract(imageR, keypointsR, descriptorsR);
+
+	CameraParams camera;
+	camera.fx = FX;
+	camera.fy = FX;
+	camera.bf = BF;
+	camera.baseline = BF / FX;
+
+	StereoMatcher matcher;
+	std::vector<float> uright, depth;
+	const double ms = MeanMs([&]()
+	{
+		matcher.Compute(
+			keypointsL, descriptorsL, extractorL.GetImagePyramid(),
+			keypointsR, descriptorsR, extractorR.GetImagePyramid(),
+			extractorL.GetScaleFactors(), extractorL.GetInverseScaleFactors(), camera, uright, depth);
+	});
+
+	const auto hasDepth = [](float d) { return d > 0; };
+	const size_t nmatches = std::count_if(std::begin(depth), std::end(depth), hasDepth);
+
+#if defined(SCALAR_PATCH_DISTANCE)
+	const char* sweep = "scalar PatchDistance";
+#else
+	const char* sweep = "SIMD sweep";
+#endif
+
+	std::cout << name << " (" << imageL.cols << "x" << imageL.rows << ", " << keypointsL.size() << " left and "
+		<< keypointsR.size() << " right keypoints)" << std::endl;
+	std::cout << std::fixed << std::setprecision(3);
+	std::cout << "  StereoMatcher::Compute, " << sweep << ": " << ms << " ms, " << nmatches << " matches" << std::endl;
+}
+
+static cv::Mat RandomTexture(int width, int height)
+{
+	cv::Mat image(height, width, CV_8U);
+	cv::randu(image, cv::Scalar(0), cv::Scalar(256));
+	cv::GaussianBlur(image, image, cv::Size(0, 0), 1.5);
+	return image;
+}
+
+// A point at u in image is at u - disparity in the returned image
+static cv::Mat ShiftedCopy(const cv::Mat& image)
+{
+	cv::Mat mapx(image.size(), CV_32F), mapy(image.size(), CV_32F);
+	for (int y = 0; y < image.rows; y++)
+	{
+		const float disparity = MIN_DISPARITY + (MAX_DISPARITY - MIN_DISPARITY) * y / image.rows;
+		for (int x = 0; x < image.cols; x++)
+		{
+			mapx.at<float>(y, x) = x + disparity;
+			mapy.at<float>(y, x) = static_cast<float>(y);
+		}
+	}
+
+	cv::Mat shifted;
+	cv::remap(image, shifted, mapx, mapy, cv::INTER_LINEAR, cv::BORDER_REFLECT_101);
+	return shifted;
+}
+
+int main(int argc, char** argv)
+{
+	cv::setNumThreads(1);
+
+	if (argc < 3)
+	{
+		const cv::Mat imageL = RandomTexture(1241, 376);
+		Benchmark("KITTI size", imageL, ShiftedCopy(imageL));
+		return 0;
+	}
+
+	const cv::Mat imageL = cv::imread(argv[1], cv::IMREAD_GRAYSCALE);
+	const cv::Mat imageR = cv::imread(argv[2], cv::IMREAD_GRAYSCALE);
+	if (imageL.empty() || imageR.empty())
+	{
+		std::cerr << "Failed to load the images at: " << argv[1] << " " << argv[2] << std::endl;
+		return 1;
+	}
+	Benchmark(argv[1], imageL, imageR);
+
+	return 0;
+}
@@ -0,0 +1,127 @@
+/**
+* This file is part of ORB-SLAM2.
+*
+* Copyright (C) 2014-2016 Raúl Mur-Artal <raulmur at unizar dot es> (University of Zaragoza)
+* For more information see <https://github.com/raulmur/ORB_SLAM2>
+*
+* ORB-SLAM2 is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* ORB-SLAM2 is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with ORB-SLAM2. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef DESCRIPTOR_H
+#define DESCRIPTOR_H
+
+#include <vector>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+
+#include <opencv2/core.hpp>
+
+#include "DescriptorDistance.h"
+
+namespace ORB_SLAM2
+{
+
+// An ORB descriptor, read and copied without the cv::Mat header and its reference count
+struct alignas(DESCRIPTOR_SIZE) Descriptor
+{
+	uint8_t data[DESCRIPTOR_SIZE];
+};
+
+// The compiler may copy descriptors with aligned 32-byte loads and stores (e.g. AVX2),
+// so every allocation holding them must be 32-byte aligned
+static_assert(alignof(Descriptor) == 32, "Descriptor must be 32-byte aligned");
+
+// Allocates size bytes aligned to alignment (a power of two), to be released with AlignedFree.
+// Neither operator new before C++17 nor cv::fastMalloc (16 bytes in OpenCV 3) guarantee 32 bytes.
+// The block returned by malloc is stored just before the aligned pointer.
+static inline void* AlignedMalloc(size_t size, size_t alignment)
+{
+	void* block = std::malloc(size + alignment - 1 + sizeof(void*));
+	if (!block)
+		throw std::bad_alloc();
+
+	const uintptr_t address = reinterpret_cast<uintptr_t>(block) + sizeof(void*);
+	void** aligned = reinterpret_cast<void**>((address + alignment - 1) & ~static_cast<uintptr_t>(alignment - 1));
+	aligned[-1] = block;
+	return aligned;
+}
+
+static inline void AlignedFree(void* ptr)
+{
+	if (ptr)
+		std::free(static_cast<void**>(ptr)[-1]);
+}
+
+// std::allocator does not honor the alignment of Descriptor before C++17
+template <typename T>
+struct AlignedAllocator
+{
+	using value_type = T;
+
+	AlignedAllocator() = default;
+	template <typename U> AlignedAllocator(const AlignedAllocator<U>&) {}
+
+	T* allocate(size_t n) { return static_cast<T*>(AlignedMalloc(n * sizeof(T), alignof(T))); }
+	void deallocate(T* ptr, size_t) { AlignedFree(ptr); }
+
+	template <typename U> bool operator==(const AlignedAllocator<U>&) const { return true; }
+	template <typename U> bool operator!=(const AlignedAllocator<U>&) const { return false; }
+};
+
+// Descriptors stored contiguously, each associated to a keypoint by its index
+using Descriptors = std::vector<Descriptor, AlignedAllocator<Descriptor>>;
+
+static inline int DescriptorDistance(const Descriptor& a, const Descriptor& b)
+{
+	return DescriptorDistance(a.data, b.data);
+}
+
+// Distances from a to the n descriptors starting at b
+static inline void DescriptorDistances(const Descriptor& a, const Descriptor* b, int n, int* distances)
+{
+	DescriptorDistances(a.data, b->data, sizeof(Descriptor), n, distances);
+}
+
+// Conversions from/to the N x 32 CV_8U matrices of the extractor and the public API
+static inline void ToDescriptors(const cv::Mat& mat, Descriptors& descriptors)
+{
+	CV_Assert(mat.empty() || (mat.type() == CV_8U && mat.cols == DESCRIPTOR_SIZE));
+	descriptors.resize(mat.rows);
+	for (int i = 0; i < mat.rows; i++)
+		std::memcpy(descriptors[i].data, mat.ptr<uint8_t>(i), DESCRIPTOR_SIZE);
+}
+
+static inline Descriptors ToDescriptors(const cv::Mat& mat)
+{
+	Descriptors descriptors;
+	ToDescriptors(mat, descriptors);
+	return descriptors;
+}
+
+// The matrix shares the data of the descriptors
+static inline cv::Mat ToMat(const Descriptors& descriptors)
+{
+	return cv::Mat(static_cast<int>(descriptors.size()), DESCRIPTOR_SIZE, CV_8U, const_cast<Descriptor*>(descriptors.data()));
+}
+
+// The returned matrix owns a copy of the descriptor
+static inline cv::Mat ToMat(const Descriptor& descriptor)
+{
+	return cv::Mat(1, DESCRIPTOR_SIZE, CV_8U, const_cast<uint8_t*>(descriptor.data)).clone();
+}
+
+} // namespace ORB_SLAM2
+
+#endif // DESCRIPTOR_H
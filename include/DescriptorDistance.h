@@ -0,0 +1,72 @@
+/**
+* This file is part of ORB-SLAM2.
+*
+* Copyright (C) 2014-2016 Raúl Mur-Artal <raulmur at unizar dot es> (University of Zaragoza)
+* For more information see <https://github.com/raulmur/ORB_SLAM2>
+*
+* ORB-SLAM2 is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* ORB-SLAM2 is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with ORB-SLAM2. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef DESCRIPTOR_DISTANCE_H
+#define DESCRIPTOR_DISTANCE_H
+
+#include <cstdint>
+#include <cstring>
+#include <cstddef>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+namespace ORB_SLAM2
+{
+
+// Size in bytes of an ORB descriptor (256 bits)
+const int DESCRIPTOR_SIZE = 32;
+
+static inline int Popcount64(uint64_t x)
+{
+#if defined(_MSC_VER) && defined(_M_X64)
+	return static_cast<int>(__popcnt64(x));
+#elif defined(_MSC_VER)
+	return static_cast<int>(__popcnt(static_cast<uint32_t>(x)) + __popcnt(static_cast<uint32_t>(x >> 32)));
+#else
+	return __builtin_popcountll(x);
+#endif
+}
+
+// Hamming distance between two descriptors, with four 64-bit popcounts
+static inline int DescriptorDistance(const uint8_t* a, const uint8_t* b)
+{
+	uint64_t x[4], y[4];
+	std::memcpy(x, a, DESCRIPTOR_SIZE);
+	std::memcpy(y, b, DESCRIPTOR_SIZE);
+	return Popcount64(x[0] ^ y[0]) + Popcount64(x[1] ^ y[1]) + Popcount64(x[2] ^ y[2]) + Popcount64(x[3] ^ y[3]);
+}
+
+// Distances from the descriptor a to the n descriptors starting at b, stride bytes apart.
+// Uses the fastest implementation the CPU supports (AVX-512 VPOPCNTDQ, AVX2, NEON or 64-bit popcount),
+// selected at runtime.
+void DescriptorDistances(const uint8_t* a, const uint8_t* b, size_t stride, int n, int* distances);
+
+// Distances between each of the m descriptors starting at a and each of the n descriptors starting at b.
+// distances is a m x n row-major matrix.
+void DescriptorDistances(const uint8_t* a, size_t strideA, int m, const uint8_t* b, size_t strideB, int n, int* distances);
+
+// Name of the implementation in use
+const char* DescriptorDistanceBackend();
+
+} // namespace ORB_SLAM2
+
+#endif // DESCRIPTOR_DISTANCE_H
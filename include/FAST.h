@@ -0,0 +1,46 @@
+/**
+* This file is part of ORB-SLAM2.
+*
+* Copyright (C) 2014-2016 Raúl Mur-Artal <raulmur at unizar dot es> (University of Zaragoza)
+* For more information see <https://github.com/raulmur/ORB_SLAM2>
+*
+* ORB-SLAM2 is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* ORB-SLAM2 is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with ORB-SLAM2. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef FAST_H
+#define FAST_H
+
+#include <opencv2/core.hpp>
+
+#include "Point.h"
+
+namespace ORB_SLAM2
+{
+
+// Computes the FAST-9 score of every pixel in roi and writes it to scores (CV_8U, same size as image).
+// The score of a corner is the highest threshold for which cv::FAST still detects it.
+// Pixels that are not corners for the given threshold (>= 1) get 0, so one pass serves every higher threshold.
+// roi must be at least 3 pixels away from the image border.
+// If mask (CV_8U, same size as image) is given, pixels where it is zero are not detected.
+void ComputeFASTScores(const cv::Mat& image, const cv::Rect& roi, int threshold, cv::Mat& scores,
+	const cv::Mat& mask = cv::Mat());
+
+// Appends the pixels in roi with score >= threshold that are strict maxima of their 3x3 neighborhood,
+// in row-major order, as cv::FAST does with non-max suppression.
+// The comparison uses the scores around roi, so roi must be at least 1 pixel away from the border.
+void FASTNonMaxSuppression(const cv::Mat& scores, const cv::Rect& roi, int threshold, KeyPoints& keypoints);
+
+} // namespace ORB_SLAM2
+
+#endif // FAST_H
@@ -22,6 +22,8 @@
 #define FRAME_H
 
 #include <vector>
+#include <algorithm>
+#include <cmath>
 
 #include <opencv2/core.hpp>
 
@@ -30,6 +32,7 @@
 #include "CameraParameters.h"
 #include "CameraPose.h"
 #include "Point.h"
+#include "Descriptor.h"
 
 namespace ORB_SLAM2
 {
@@ -66,19 +69,69 @@ public:
 	FeaturesGrid();
 	FeaturesGrid(const KeyPoints& keypoints, const ImageBounds& imageBounds, int nlevels);
 	void AssignFeatures(const KeyPoints& keypoints, const ImageBounds& imageBounds, int nlevels);
+
+	// Indices of the keypoints within a square of half side r around (x, y),
+	// with level in [minLevel, maxLevel] (a negative minLevel/maxLevel means no bound)
 	std::vector<size_t> GetFeaturesInArea(float x, float y, float r, int minLevel = -1, int maxLevel = -1) const;
 
+	// Same as above, appending the indices to the given vector so that its memory can be reused
+	void GetFeaturesInArea(float x, float y, float r, int minLevel, int maxLevel, std::vector<size_t>& indices) const;
+
+	// Same as above, calling func(idx) for each keypoint without storing the indices
+	template <typename Func>
+	void ForEachFeatureInArea(float x, float y, float r, int minLevel, int maxLevel, Func func) const;
+
+	// Index of the cell containing the point (clamped to the grid), used to group nearby queries.
+	// The cells are numbered row by row, independently of the order they are stored in.
+	int GetCellIndex(float x, float y) const;
+
 private:
+
+	// Range of the cells overlapping the area, false if there is none
+	bool GetCellRange(float x, float y, float r, int& mincx, int& maxcx, int& mincy, int& maxcy) const;
+
 	static const int ROWS = 48;
 	static const int COLS = 64;
 	float invW_;
 	float invH_;
-	KeyPoints keypoints_;
 	ImageBounds imageBounds_;
 	int nlevels_;
-	std::vector<std::size_t> grid_[COLS][ROWS];
+
+	// The keypoints of each cell, sorted by level: those of level l in the cell c are in
+	// [levelOffsets_[c * (nlevels_ + 1) + l], levelOffsets_[c * (nlevels_ + 1) + l + 1]) of indices_ and points_.
+	// The cells are stored column by column, so the level filter is a range and a query reads contiguous memory.
+	std::vector<int> levelOffsets_;
+	std::vector<int> indices_;
+	std::vector<cv::Point2f> points_;
 };
 
+template <typename Func>
+void FeaturesGrid::ForEachFeatureInArea(float x, float y, float r, int minLevel, int maxLevel, Func func) const
+{
+	int mincx, maxcx, mincy, maxcy;
+	if (!GetCellRange(x, y, r, mincx, maxcx, mincy, maxcy))
+		return;
+
+	minLevel = std::max(minLevel, 0);
+	maxLevel = maxLevel < 0 ? nlevels_ - 1 : std::min(maxLevel, nlevels_ - 1);
+	if (minLevel > maxLevel)
+		return;
+
+	for (int cx = mincx; cx <= maxcx; cx++)
+	{
+		for (int cy = mincy; cy <= maxcy; cy++)
+		{
+			const int* offsets = levelOffsets_.data() + (cx * ROWS + cy) * (nlevels_ + 1);
+			for (int k = offsets[minLevel]; k < offsets[maxLevel + 1]; k++)
+			{
+				const cv::Point2f& pt = points_[k];
+				if (std::fabs(pt.x - x) < r && std::fabs(pt.y - y) < r)
+					func(static_cast<size_t>(indices_[k]));
+			}
+		}
+	}
+}
+
 class Frame
 {
 public:
@@ -108,6 +161,9 @@ public:
 
 	std::vector<size_t> GetFeaturesInArea(float x, float y, float r, int minLevel = -1, int maxLevel = -1) const;
 
+	// Appends the indices to the given vector, see FeaturesGrid
+	void GetFeaturesInArea(float x, float y, float r, int minLevel, int maxLevel, std::vector<size_t>& indices) const;
+
 	// Backprojects a keypoint (if stereo/depth info available) into 3D world coordinates.
 	Point3D UnprojectStereo(int i) const;
 
@@ -141,8 +197,8 @@ public:
 	DBoW2::BowVector bowVector;
 	DBoW2::FeatureVector featureVector;
 
-	// ORB descriptor, each row associated to a keypoint.
-	cv::Mat descriptors;
+	// ORB descriptor, each associated to a keypoint.
+	Descriptors descriptors;
 
 	// MapPoints associated to keypoints, NULL pointer if no association.
 	std::vector<MapPoint*> mappoints;
@@ -81,6 +81,7 @@ public:
 
 	// KeyPoint functions
 	std::vector<size_t> GetFeaturesInArea(float x, float y, float r) const;
+	void GetFeaturesInArea(float x, float y, float r, std::vector<size_t>& indices) const;
 	Point3D UnprojectStereo(int i) const;
 
 	// Image
@@ -141,7 +142,7 @@ public:
 	const KeyPoints keypointsUn;
 	const std::vector<float> uright; // negative value for monocular points
 	const std::vector<float> depth; // negative value for monocular points
-	const cv::Mat descriptorsL;
+	const Descriptors descriptorsL;
 
 	//BoW
 	DBoW2::BowVector bowVector;
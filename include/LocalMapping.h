@@ -30,6 +30,7 @@ class Tracking;
 class LoopClosing;
 class Map;
 class KeyFrame;
+class ThreadPool;
 
 class LocalMapping
 {
@@ -37,7 +38,10 @@ public:
 
 	using Pointer = std::unique_ptr<LocalMapping>;
 
-	static Pointer Create(Map* map, bool monocular, float thDepth);
+	// If pool is given, the fusion of duplicated map points and the triangulation of new ones process
+	// the neighbor keyframes concurrently, at a lower priority than the other work of the pool.
+	// The pool must outlive the local mapping.
+	static Pointer Create(Map* map, bool monocular, float thDepth, ThreadPool* pool = nullptr);
 
 	virtual void SetTracker(Tracking* tracker) = 0;
 	
@@ -59,6 +63,9 @@ public:
 	virtual void SetAcceptKeyFrames(bool flag) = 0;
 	virtual bool SetNotStop(bool flag) = 0;
 
+	// Blocks until the local mapping has stopped (or finished) after a RequestStop
+	virtual void WaitUntilStopped() const = 0;
+
 	virtual void InterruptBA() = 0;
 
 	virtual void RequestFinish() = 0;
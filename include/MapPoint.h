@@ -28,6 +28,7 @@
 
 #include "FrameId.h"
 #include "Point.h"
+#include "Descriptor.h"
 
 namespace ORB_SLAM2
 {
@@ -45,6 +46,10 @@ public:
 	MapPoint(const Point3D& Xw, KeyFrame* referenceKF, Map* map);
 	MapPoint(const Point3D& Xw, Map* map, Frame* frame, int idx);
 
+	// The descriptor is over-aligned, which the default operator new honors only from C++17
+	static void* operator new(size_t size) { return AlignedMalloc(size, alignof(MapPoint)); }
+	static void operator delete(void* ptr) { AlignedFree(ptr); }
+
 	void SetWorldPos(const Point3D& Xw);
 	Point3D GetWorldPos() const;
 
@@ -72,7 +77,7 @@ public:
 	
 	void ComputeDistinctiveDescriptors();
 
-	cv::Mat GetDescriptor() const;
+	Descriptor GetDescriptor() const;
 
 	void UpdateNormalAndDepth();
 
@@ -124,7 +129,7 @@ protected:
 	Vec3D normal_;
 
 	// Best descriptor to fast matching
-	cv::Mat descriptor_;
+	Descriptor descriptor_;
 
 	// Reference KeyFrame
 	KeyFrame* referenceKF_;
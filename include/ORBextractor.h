@@ -23,6 +23,7 @@
 
 #include <vector>
 #include <list>
+#include <memory>
 
 #include <opencv2/core.hpp>
 
@@ -31,10 +32,24 @@
 namespace ORB_SLAM2
 {
 
+class ThreadPool;
+class QuadTree;
+
 class ORBextractor
 {
 public:
 
+	// How the descriptors are computed:
+	// DESCRIPTOR_REFERENCE rotates each test of the pattern on the fly (original implementation),
+	// DESCRIPTOR_EXACT rotates the pattern once per keypoint and gives the same descriptors as the reference,
+	// DESCRIPTOR_QUANTIZED uses the pattern precomputed for the closest of 30 angle bins (12 degrees each).
+	enum DescriptorMode
+	{
+		DESCRIPTOR_REFERENCE = 0,
+		DESCRIPTOR_EXACT = 1,
+		DESCRIPTOR_QUANTIZED = 2
+	};
+
 	struct Parameters
 	{
 		int nfeatures;
@@ -42,26 +57,54 @@ public:
 		int nlevels;
 		int iniThFAST;
 		int minThFAST;
+		int nthreads;
+		int descriptorMode;
+		bool thresholdMemory;
 
-		Parameters(int nfeatures = 2000, float scaleFactor = 1.2f, int nlevels = 8, int iniThFAST = 20, int minThFAST = 7);
+		Parameters(int nfeatures = 2000, float scaleFactor = 1.2f, int nlevels = 8, int iniThFAST = 20, int minThFAST = 7,
+			int nthreads = 1, int descriptorMode = DESCRIPTOR_EXACT, bool thresholdMemory = false);
 	};
 
-	ORBextractor(const Parameters& param);
+	// If pool is given, the work is submitted to it instead of a pool of nthreads owned by the extractor,
+	// so that several extractors can share the same threads. The pool must outlive the extractor.
+	ORBextractor(const Parameters& param, ThreadPool* pool = nullptr);
+	~ORBextractor();
 	void Init();
 
 	// Compute the ORB features and descriptors on an image.
 	// ORB are dispersed on the image using an octree.
-	// Mask is ignored in the current implementation.
+	// If a mask is set, features are only detected where it is non zero.
+	// If nthreads > 1 or a pool is given, pyramid levels and image cells are processed concurrently.
+	// The output is the same as in the serial case.
 	void Extract(const cv::Mat& image, KeyPoints& keypoints, cv::Mat& descriptors);
 
+	// Sets the mask (CV_8U, same size as the images) of the pixels where features are detected,
+	// e.g. to leave out a car hood or a rig that is always in view. A rectangle acts as a region of interest.
+	// The features of each level are distributed over the valid area only. An empty mask detects everywhere.
+	void SetMask(const cv::Mat& mask);
+
+	// Change the number of features and the FAST thresholds between frames
+	void SetNumFeatures(int nfeatures);
+	void SetFASTThresholds(int iniThFAST, int minThFAST);
+
+	// If thresholdMemory is set, the cells that found no corner at iniThFAST keep using minThFAST
+	// in the next frames, which keeps their number of features stable.
+	// Forget the remembered thresholds when the scene changes, e.g. after a reset or a fast motion.
+	void ResetThresholdMemory();
+
+	int GetNumFeatures() const;
 	int GetLevels() const;
 	float GetScaleFactor() const;
 	const std::vector<float>& GetScaleFactors() const;
 	const std::vector<float>& GetInverseScaleFactors() const;
 	const std::vector<float>& GetScaleSigmaSquares() const;	
 	const std::vector<float>& GetInverseScaleSigmaSquares() const;
+	// The first level refers to the last image given to Extract, without copy
 	const std::vector<cv::Mat>& GetImagePyramid() const;
 
+	// Pyramid smoothed with the 7x7 Gaussian the descriptors are computed on
+	const std::vector<cv::Mat>& GetBlurredPyramid() const;
+
 private:
 
 	std::vector<int> nfeaturesPerScale_, umax_;
@@ -73,10 +116,23 @@ private:
 
 	std::vector<cv::Mat> images_;
 	std::vector<cv::Mat> blurImages_;
+	std::vector<cv::Mat> scores_;
 	std::vector<KeyPoints> keypoints_;
+	std::vector<KeyPoints> candidates_;
+	std::vector<std::vector<uchar>> lowThresholdCells_;
+	std::vector<std::unique_ptr<QuadTree>> quadTrees_;
+
+	cv::Mat mask_;
+	std::vector<cv::Mat> maskPyramid_;
+	std::vector<cv::Rect> maskRects_;
+	std::vector<double> maskRatios_;
+	std::vector<int> maskedNumFeatures_;
 	std::vector<cv::Point> pattern_;
+	cv::Mat rotatedPatterns_;
 
 	Parameters param_;
+	std::unique_ptr<ThreadPool> threadPool_;
+	ThreadPool* pool_;
 };
 
 } //namespace ORB_SLAM
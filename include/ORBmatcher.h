@@ -36,13 +36,75 @@
 namespace ORB_SLAM2
 {
 
+class ThreadPool;
+
 using Pyramid = std::vector<cv::Mat>;
 
-void ComputeStereoMatches(
-	const KeyPoints& keypointsL, const cv::Mat& descriptorsL, const Pyramid& pyramidL,
-	const KeyPoints& keypointsR, const cv::Mat& descriptorsR, const Pyramid& pyramidR,
-	const std::vector<float>& scaleFactors, const std::vector<float>& invScaleFactors, const CameraParams& camera,
-	std::vector<float>& uright, std::vector<float>& depth);
+class StereoMatcher
+{
+public:
+
+	// Search a match for each keypoint in the left image to a keypoint in the right image.
+	// If there is a match, depth is computed and the right coordinate associated to the left keypoint is stored.
+	// If pool is given, the left keypoints are matched concurrently. The result is the same as in the serial case.
+	void Compute(
+		const KeyPoints& keypointsL, const cv::Mat& descriptorsL, const Pyramid& pyramidL,
+		const KeyPoints& keypointsR, const cv::Mat& descriptorsR, const Pyramid& pyramidR,
+		const std::vector<float>& scaleFactors, const std::vector<float>& invScaleFactors, const CameraParams& camera,
+		std::vector<float>& uright, std::vector<float>& depth, ThreadPool* pool = nullptr);
+
+private:
+
+	// A right keypoint in the row index
+	struct Candidate
+	{
+		float u;
+		int octave;
+		int idx;
+	};
+
+	// Right keypoints of each image row sorted by u, in the range [rowOffsets_[y], rowOffsets_[y + 1])
+	// of candidates_. The buffers are kept between frames.
+	std::vector<int> rowOffsets_;
+	std::vector<Candidate> candidates_;
+	std::vector<int> rowEnds_;
+	std::vector<int> sortedIndices_;
+
+	// (distance, left index) of the matches found by each chunk of left keypoints, and all of them
+	std::vector<std::vector<std::pair<int, int>>> chunkDistIndices_;
+	std::vector<std::pair<int, int>> distIndices_;
+};
+
+class ProjectionMatcher
+{
+public:
+
+	// Search matches between Frame keypoints and projected MapPoints. Returns number of matches.
+	// The candidates of all the points are gathered first, grouped by grid cell, and their distances
+	// computed in batches; the matches are then assigned in the order of mappoints, as in
+	// ORBmatcher::SearchByProjection. The buffers are kept between calls.
+	int Search(Frame& frame, const std::vector<MapPoint*>& mappoints, float th, float nnratio);
+
+private:
+
+	// A projected MapPoint and its candidates in [begin, end) of candidates_
+	struct Query
+	{
+		int idx;
+		int cell;
+		int begin;
+		int end;
+	};
+
+	std::vector<Query> queries_;
+	std::vector<std::pair<int, int>> cellOrder_;
+	// Candidates of all the queries, and the distance of each one to its map point
+	std::vector<size_t> candidates_;
+	std::vector<int> distances_;
+
+	// Descriptors of the candidates of the current query
+	Descriptors candidateDescriptors_;
+};
 
 class ORBmatcher
 {
@@ -51,10 +113,12 @@ public:
 	ORBmatcher(float nnratio = 0.6, bool checkOri = true);
 
 	// Computes the Hamming distance between two ORB descriptors
+	static int DescriptorDistance(const Descriptor& a, const Descriptor& b);
 	static int DescriptorDistance(const cv::Mat& a, const cv::Mat& b);
 
 	// Search matches between Frame keypoints and projected MapPoints. Returns number of matches
-	// Used to track the local map (Tracking)
+	// Forwards to a ProjectionMatcher created for the call. Callers on hot paths should own a ProjectionMatcher,
+	// as the local map tracking does, so that its buffers are kept between calls.
 	int SearchByProjection(Frame& frame, const std::vector<MapPoint*>& mappoints, float th = 3);
 
 	// Project MapPoints tracked in last frame into the current frame and search matches.
@@ -92,6 +156,18 @@ public:
 	// Project MapPoints into KeyFrame and search for duplicated MapPoints.
 	int Fuse(KeyFrame* keyframe, const std::vector<MapPoint*>& mappoints, float th = 3.f);
 
+	// A MapPoint and the index of the keypoint of the KeyFrame it is fused with
+	using FuseMatch = std::pair<MapPoint*, int>;
+
+	// The two steps of Fuse. FuseSearch only reads the map, so that several searches can run concurrently.
+	// It appends the matches of mappoints[begin, end) to matches, in order.
+	void FuseSearch(KeyFrame* keyframe, const std::vector<MapPoint*>& mappoints, size_t begin, size_t end,
+		std::vector<FuseMatch>& matches, float th = 3.f) const;
+
+	// Replaces or adds the MapPoints of the matches in order, skipping those that earlier fusions made bad
+	// or already added to the KeyFrame. Returns the number of fused MapPoints.
+	static int FuseApply(KeyFrame* keyframe, const std::vector<FuseMatch>& matches);
+
 	// Project MapPoints into KeyFrame using a given Sim3 and search for duplicated MapPoints.
 	int Fuse(KeyFrame* keyframe, const Sim3& Scw, const std::vector<MapPoint*>& mappoints,
 		float th, std::vector<MapPoint*>& replacePoints);
@@ -38,6 +38,21 @@ public:
 
 	enum Sensor { MONOCULAR = 0, STEREO = 1, RGBD = 2 };
 
+	// Layout of the input images, converted to grayscale before tracking.
+	enum InputFormat
+	{
+		INPUT_COLOR = 0,    // RGB/BGR (CV_8UC3 or CV_8UC4, order given by Camera.RGB) or grayscale (CV_8U)
+		INPUT_NV12 = 1,     // YUV 4:2:0 (CV_8U, height * 3/2 rows), Y plane first. The Y plane is used without copy.
+		INPUT_NV21 = 2,
+		INPUT_I420 = 3,
+		INPUT_YUYV = 4,     // YUV 4:2:2 packed (CV_8UC2)
+		INPUT_UYVY = 5,
+		INPUT_BAYER_BG = 6, // Raw Bayer (CV_8U), named as in OpenCV, demosaiced directly to grayscale
+		INPUT_BAYER_GB = 7,
+		INPUT_BAYER_RG = 8,
+		INPUT_BAYER_GR = 9
+	};
+
 	using Pointer = std::unique_ptr<System>;
 	using Path = std::string;
 
@@ -49,9 +64,17 @@ public:
 	// Returns the camera pose (empty if tracking fails).
 	virtual cv::Mat TrackStereo(const cv::Mat& imageL, const cv::Mat& imageR, double timestamp) = 0;
 
+	// Proccess the given stereo frame with a disparity map computed upstream (e.g. by SGM), registered to the left image.
+	// The right image is not needed, the disparity is sampled at the left keypoints.
+	// Input image: RGB (CV_8UC3) or grayscale (CV_8U). RGB is converted to grayscale.
+	// Input disparity: Float (CV_32F) in pixels, or fixed point (CV_16S) with 4 fractional bits as cv::StereoSGBM.
+	// Non positive disparities are invalid.
+	// Returns the camera pose (empty if tracking fails).
+	virtual cv::Mat TrackStereoDisparity(const cv::Mat& imageL, const cv::Mat& disparity, double timestamp) = 0;
+
 	// Process the given rgbd frame. Depthmap must be registered to the RGB frame.
 	// Input image: RGB (CV_8UC3) or grayscale (CV_8U). RGB is converted to grayscale.
-	// Input depthmap: Float (CV_32F).
+	// Input depthmap: raw (CV_16U) or Float (CV_32F), scaled by DepthMapFactor.
 	// Returns the camera pose (empty if tracking fails).
 	virtual cv::Mat TrackRGBD(const cv::Mat& image, const cv::Mat& depth, double timestamp) = 0;
 
@@ -60,6 +83,10 @@ public:
 	// Returns the camera pose (empty if tracking fails).
 	virtual cv::Mat TrackMonocular(const cv::Mat& image, double timestamp) = 0;
 
+	// Sets the layout of the images given to the Track functions (Camera.format in the settings).
+	// Call it between frames.
+	virtual void SetInputFormat(InputFormat format) = 0;
+
 	// This stops local mapping thread (map building) and performs only camera tracking.
 	virtual void ActivateLocalizationMode() = 0;
 	// This resumes local mapping thread and performs SLAM again.
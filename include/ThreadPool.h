@@ -0,0 +1,74 @@
+/**
+* This file is part of ORB-SLAM2.
+*
+* Copyright (C) 2014-2016 Raúl Mur-Artal <raulmur at unizar dot es> (University of Zaragoza)
+* For more information see <https://github.com/raulmur/ORB_SLAM2>
+*
+* ORB-SLAM2 is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* ORB-SLAM2 is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with ORB-SLAM2. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <vector>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+namespace ORB_SLAM2
+{
+
+class ThreadPool
+{
+public:
+
+	// The workers serve the high priority calls first. They take the indices of a low priority call
+	// one at a time, so that a high priority call waits at most for the index in progress.
+	enum Priority
+	{
+		PRIORITY_HIGH,
+		PRIORITY_LOW
+	};
+
+	// Creates a pool that runs the work on nthreads threads, the calling thread included.
+	// A pool with a single thread runs everything in the calling thread.
+	ThreadPool(int nthreads);
+	~ThreadPool();
+
+	int NumThreads() const;
+
+	// Calls func(i) for each i in [0, n) and waits until all calls have finished.
+	// The calling thread takes part in the work, so ParallelFor can be nested.
+	// Indices are claimed in increasing order, put the heaviest work first.
+	void ParallelFor(int n, const std::function<void(int)>& func, Priority priority = PRIORITY_HIGH);
+
+private:
+
+	struct Task;
+
+	void WorkerLoop();
+
+	std::vector<std::thread> workers_;
+	std::deque<std::shared_ptr<Task>> tasks_;
+	std::mutex mutexTasks_;
+	std::condition_variable newTask_;
+	bool stop_;
+};
+
+} // namespace ORB_SLAM2
+
+#endif // THREADPOOL_H
@@ -97,6 +97,9 @@ public:
 	virtual int GetState() const = 0;
 	virtual int GetLastProcessedState() const = 0;
 
+	// Number of inliers of the last frame after tracking the local map (0 if it was not tracked)
+	virtual int GetMatchesInliers() const = 0;
+
 	virtual const Frame& GetInitialFrame() const = 0;
 	virtual const std::vector<int>& GetIniMatches() const = 0;
 	virtual const std::vector<int>& GetNumObservations() const = 0;
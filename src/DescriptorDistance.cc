@@ -0,0 +1,215 @@
+/**
+* This file is part of ORB-SLAM2.
+*
+* Copyright (C) 2014-2016 RaYl Mur-Artal <raulmur at unizar dot es> (University of Zaragoza)
+* For more information see <https://github.com/raulmur/ORB_SLAM2>
+*
+* ORB-SLAM2 is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* ORB-SLAM2 is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with ORB-SLAM2. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "DescriptorDistance.h"
+
+// The x86 implementations are compiled for their instruction sets whatever the build flags,
+// and selected with the features of the CPU at runtime
+#if (defined(__GNUC__) || defined(__clang__)) && defined(__x86_64__)
+#define X86_DISPATCH
+#include <immintrin.h>
+#define TARGET_POPCNT __attribute__((target("popcnt")))
+#define TARGET_AVX2 __attribute__((target("avx2,popcnt")))
+#if __GNUC__ >= 8 || __clang_major__ >= 7
+#define HAVE_AVX512_POPCNT
+#define TARGET_AVX512 __attribute__((target("avx512f,avx512vpopcntdq,avx2,popcnt")))
+#endif
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+namespace ORB_SLAM2
+{
+
+using DistancesFunc = void (*)(const uint8_t* a, const uint8_t* b, size_t stride, int n, int* distances);
+
+static void DistancesPopcount(const uint8_t* a, const uint8_t* b, size_t stride, int n, int* distances)
+{
+	for (int i = 0; i < n; i++, b += stride)
+		distances[i] = DescriptorDistance(a, b);
+}
+
+#if defined(X86_DISPATCH)
+
+// Same as DistancesPopcount with the popcnt instruction
+TARGET_POPCNT static void DistancesPopcnt(const uint8_t* a, const uint8_t* b, size_t stride, int n, int* distances)
+{
+	for (int i = 0; i < n; i++, b += stride)
+		distances[i] = DescriptorDistance(a, b);
+}
+
+// Number of bits set in each 8 bytes of a ^ b, in the 4 64-bit lanes (nibble lookup table)
+TARGET_AVX2 static inline __m256i PopcountAVX2(__m256i a, const uint8_t* b)
+{
+	const __m256i lut = _mm256_setr_epi8(
+		0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+		0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+	const __m256i lowMask = _mm256_set1_epi8(0x0f);
+
+	const __m256i x = _mm256_xor_si256(a, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b)));
+	const __m256i lo = _mm256_shuffle_epi8(lut, _mm256_and_si256(x, lowMask));
+	const __m256i hi = _mm256_shuffle_epi8(lut, _mm256_and_si256(_mm256_srli_epi16(x, 4), lowMask));
+	return _mm256_sad_epu8(_mm256_add_epi8(lo, hi), _mm256_setzero_si256());
+}
+
+TARGET_AVX2 static void DistancesAVX2(const uint8_t* a, const uint8_t* b, size_t stride, int n, int* distances)
+{
+	const __m256i va = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a));
+
+	int i = 0;
+	for (; i + 4 <= n; i += 4, b += 4 * stride)
+	{
+		// The counts of the 4 descriptors go to separate 16-bit fields of the lanes (at most 64 per lane),
+		// so that a single horizontal sum gives the 4 distances
+		__m256i sum = PopcountAVX2(va, b);
+		sum = _mm256_or_si256(sum, _mm256_slli_epi64(PopcountAVX2(va, b + stride), 16));
+		sum = _mm256_or_si256(sum, _mm256_slli_epi64(PopcountAVX2(va, b + 2 * stride), 32));
+		sum = _mm256_or_si256(sum, _mm256_slli_epi64(PopcountAVX2(va, b + 3 * stride), 48));
+
+		const __m128i half = _mm_add_epi64(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+		const uint64_t fields = static_cast<uint64_t>(_mm_cvtsi128_si64(half) + _mm_extract_epi64(half, 1));
+
+		distances[i + 0] = static_cast<int>(fields & 0xffff);
+		distances[i + 1] = static_cast<int>((fields >> 16) & 0xffff);
+		distances[i + 2] = static_cast<int>((fields >> 32) & 0xffff);
+		distances[i + 3] = static_cast<int>(fields >> 48);
+	}
+
+	for (; i < n; i++, b += stride)
+		distances[i] = DescriptorDistance(a, b);
+}
+
+#if defined(HAVE_AVX512_POPCNT)
+
+// The AVX-512 intrinsics of some GCC versions trigger false uninitialized warnings
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+
+// Two descriptors in the lower and upper halves
+TARGET_AVX512 static inline __m512i Load2AVX512(const uint8_t* b0, const uint8_t* b1)
+{
+	return _mm512_inserti64x4(_mm512_castsi256_si512(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(b0))),
+		_mm256_loadu_si256(reinterpret_cast<const __m256i*>(b1)), 1);
+}
+
+TARGET_AVX512 static void DistancesAVX512(const uint8_t* a, const uint8_t* b, size_t stride, int n, int* distances)
+{
+	const __m512i va = Load2AVX512(a, a);
+
+	int i = 0;
+	for (; i + 4 <= n; i += 4, b += 4 * stride)
+	{
+		// Descriptors 0 and 1 in the lower 32 bits of each half, 2 and 3 in the upper 32 bits
+		const __m512i count01 = _mm512_popcnt_epi64(_mm512_xor_si512(va, Load2AVX512(b, b + stride)));
+		const __m512i count23 = _mm512_popcnt_epi64(_mm512_xor_si512(va, Load2AVX512(b + 2 * stride, b + 3 * stride)));
+		const __m512i sum = _mm512_or_si512(count01, _mm512_slli_epi64(count23, 32));
+
+		const uint64_t fields02 = static_cast<uint64_t>(_mm512_mask_reduce_add_epi64(0x0f, sum));
+		const uint64_t fields13 = static_cast<uint64_t>(_mm512_mask_reduce_add_epi64(0xf0, sum));
+
+		distances[i + 0] = static_cast<int>(fields02 & 0xffffffff);
+		distances[i + 1] = static_cast<int>(fields13 & 0xffffffff);
+		distances[i + 2] = static_cast<int>(fields02 >> 32);
+		distances[i + 3] = static_cast<int>(fields13 >> 32);
+	}
+
+	for (; i < n; i++, b += stride)
+		distances[i] = DescriptorDistance(a, b);
+}
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
+#endif // HAVE_AVX512_POPCNT
+
+#elif defined(__ARM_NEON)
+
+static void DistancesNEON(const uint8_t* a, const uint8_t* b, size_t stride, int n, int* distances)
+{
+	const uint8x16_t a0 = vld1q_u8(a);
+	const uint8x16_t a1 = vld1q_u8(a + 16);
+
+	for (int i = 0; i < n; i++, b += stride)
+	{
+		// At most 16 per byte
+		const uint8x16_t count = vaddq_u8(vcntq_u8(veorq_u8(a0, vld1q_u8(b))), vcntq_u8(veorq_u8(a1, vld1q_u8(b + 16))));
+#if defined(__aarch64__)
+		distances[i] = vaddlvq_u8(count);
+#else
+		const uint64x2_t sum = vpaddlq_u32(vpaddlq_u16(vpaddlq_u8(count)));
+		distances[i] = static_cast<int>(vgetq_lane_u64(sum, 0) + vgetq_lane_u64(sum, 1));
+#endif
+	}
+}
+
+#endif
+
+struct Backend
+{
+	const char* name;
+	DistancesFunc distances;
+};
+
+static Backend SelectBackend()
+{
+#if defined(X86_DISPATCH)
+	__builtin_cpu_init();
+#if defined(HAVE_AVX512_POPCNT)
+	if (__builtin_cpu_supports("avx512vpopcntdq"))
+		return { "avx512-vpopcntdq", DistancesAVX512 };
+#endif
+	if (__builtin_cpu_supports("avx2"))
+		return { "avx2", DistancesAVX2 };
+	if (__builtin_cpu_supports("popcnt"))
+		return { "popcnt", DistancesPopcnt };
+#elif defined(__ARM_NEON)
+	return { "neon", DistancesNEON };
+#endif
+	return { "popcount64", DistancesPopcount };
+}
+
+static const Backend& GetBackend()
+{
+	static const Backend backend = SelectBackend();
+	return backend;
+}
+
+void DescriptorDistances(const uint8_t* a, const uint8_t* b, size_t stride, int n, int* distances)
+{
+	GetBackend().distances(a, b, stride, n, distances);
+}
+
+void DescriptorDistances(const uint8_t* a, size_t strideA, int m, const uint8_t* b, size_t strideB, int n, int* distances)
+{
+	const DistancesFunc func = GetBackend().distances;
+	for (int i = 0; i < m; i++, a += strideA, distances += n)
+		func(a, b, strideB, n, distances);
+}
+
+const char* DescriptorDistanceBackend()
+{
+	return GetBackend().name;
+}
+
+} // namespace ORB_SLAM2
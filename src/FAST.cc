@@ -0,0 +1,441 @@
+/**
+* This file is part of ORB-SLAM2.
+* This file is based on the FAST corner detector from the OpenCV library (see BSD license below).
+*
+* Copyright (C) 2014-2016 RaYl Mur-Artal <raulmur at unizar dot es> (University of Zaragoza)
+* For more information see <https://github.com/raulmur/ORB_SLAM2>
+*
+* ORB-SLAM2 is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* ORB-SLAM2 is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with ORB-SLAM2. If not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+Copyright (c) 2006, 2008 Edward Rosten
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    *Redistributions of source code must retain the above copyright
+     notice, this list of conditions and the following disclaimer.
+
+    *Redistributions in binary form must reproduce the above copyright
+     notice, this list of conditions and the following disclaimer in the
+     documentation and/or other materials provided with the distribution.
+
+    *Neither the name of the University of Cambridge nor the names of
+     its contributors may be used to endorse or promote products derived
+     from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "FAST.h"
+
+#include <algorithm>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+namespace ORB_SLAM2
+{
+
+const int FAST_RADIUS = 3;
+
+static inline int CountTrailingZeros(uint32_t v)
+{
+#ifdef _MSC_VER
+	unsigned long idx;
+	_BitScanForward(&idx, v);
+	return static_cast<int>(idx);
+#else
+	return __builtin_ctz(v);
+#endif
+}
+
+// Offsets of the 16 pixels of the Bresenham circle of radius 3, repeated to close the ring
+static void MakeOffsets(int pixel[25], int step)
+{
+	static const int offsets[16][2] =
+	{
+		{ 0,  3 }, { 1,  3 }, { 2,  2 }, { 3,  1 }, { 3, 0 }, { 3, -1 }, { 2, -2 }, { 1, -3 },
+		{ 0, -3 }, { -1, -3 }, { -2, -2 }, { -3, -1 }, { -3, 0 }, { -3,  1 }, { -2,  2 }, { -1,  3 }
+	};
+
+	for (int k = 0; k < 16; k++)
+		pixel[k] = offsets[k][0] + offsets[k][1] * step;
+	for (int k = 16; k < 25; k++)
+		pixel[k] = pixel[k - 16];
+}
+
+// Highest threshold for which the pixel is a FAST-9 corner, or threshold - 1 if it is not a corner
+static int CornerScore(const uchar* ptr, const int pixel[25], int threshold)
+{
+	const int v = ptr[0];
+	int d[25];
+	for (int k = 0; k < 25; k++)
+		d[k] = v - ptr[pixel[k]];
+
+	// Darker arcs
+	int a0 = threshold;
+	for (int k = 0; k < 16; k += 2)
+	{
+		int a = std::min(d[k + 1], d[k + 2]);
+		a = std::min(a, d[k + 3]);
+		if (a <= a0)
+			continue;
+		a = std::min(a, d[k + 4]);
+		a = std::min(a, d[k + 5]);
+		a = std::min(a, d[k + 6]);
+		a = std::min(a, d[k + 7]);
+		a = std::min(a, d[k + 8]);
+		a0 = std::max(a0, std::min(a, d[k]));
+		a0 = std::max(a0, std::min(a, d[k + 9]));
+	}
+
+	// Brighter arcs
+	int b0 = -a0;
+	for (int k = 0; k < 16; k += 2)
+	{
+		int b = std::max(d[k + 1], d[k + 2]);
+		b = std::max(b, d[k + 3]);
+		b = std::max(b, d[k + 4]);
+		b = std::max(b, d[k + 5]);
+		if (b >= b0)
+			continue;
+		b = std::max(b, d[k + 6]);
+		b = std::max(b, d[k + 7]);
+		b = std::max(b, d[k + 8]);
+		b0 = std::min(b0, std::max(b, d[k]));
+		b0 = std::min(b0, std::max(b, d[k + 9]));
+	}
+
+	return -b0 - 1;
+}
+
+// A FAST-9 arc always contains two consecutive compass points (0, 4, 8, 12) of the circle,
+// so pixels without such a pair can be rejected before computing the score.
+static inline bool IsCandidate(const uchar* ptr, const int pixel[25], int threshold)
+{
+	const int v = ptr[0];
+	const int hi = v + threshold;
+	const int lo = v - threshold;
+	const int p0 = ptr[pixel[0]], p4 = ptr[pixel[4]], p8 = ptr[pixel[8]], p12 = ptr[pixel[12]];
+
+	const int b = (p0 > hi) | ((p4 > hi) << 1) | ((p8 > hi) << 2) | ((p12 > hi) << 3);
+	const int d = (p0 < lo) | ((p4 < lo) << 1) | ((p8 < lo) << 2) | ((p12 < lo) << 3);
+
+	// rotate the bits by one position and check for two consecutive compass points
+	const int b1 = ((b >> 1) | (b << 3)) & 15;
+	const int d1 = ((d >> 1) | (d << 3)) & 15;
+	return (b & b1) || (d & d1);
+}
+
+static inline void ScorePixel(const uchar* ptr, const int pixel[25], int threshold, uchar* score)
+{
+	const int s = CornerScore(ptr, pixel, threshold);
+	*score = static_cast<uchar>(s >= threshold ? s : 0);
+}
+
+// The score of CornerScore is, over the brighter and the darker arcs of 9 contiguous circle pixels,
+// the highest smallest difference to the center in an arc, minus 1. With the differences saturated to 0,
+// it is computed for a block of pixels at once with sliding minima of width 2, 4, 8 and 9 around the circle.
+// The score is exact for the corners, the other pixels get 0.
+#if defined(__AVX2__)
+static inline __m256i MaxArcMin(const __m256i d[16])
+{
+	__m256i m2[16], m4[16];
+	for (int k = 0; k < 16; k++)
+		m2[k] = _mm256_min_epu8(d[k], d[(k + 1) & 15]);
+	for (int k = 0; k < 16; k++)
+		m4[k] = _mm256_min_epu8(m2[k], m2[(k + 2) & 15]);
+
+	__m256i result = _mm256_setzero_si256();
+	for (int k = 0; k < 16; k++)
+	{
+		const __m256i m8 = _mm256_min_epu8(m4[k], m4[(k + 4) & 15]);
+		result = _mm256_max_epu8(result, _mm256_min_epu8(m8, d[(k + 8) & 15]));
+	}
+	return result;
+}
+
+static inline __m256i BlockScores(const uchar* ptr, const int pixel[25], __m256i c, __m256i threshold)
+{
+	__m256i b[16], d[16];
+	for (int k = 0; k < 16; k++)
+	{
+		const __m256i p = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(ptr + pixel[k]));
+		b[k] = _mm256_subs_epu8(p, c);
+		d[k] = _mm256_subs_epu8(c, p);
+	}
+	const __m256i s = _mm256_max_epu8(MaxArcMin(b), MaxArcMin(d));
+
+	// corners have s > threshold
+	const __m256i notCorner = _mm256_cmpeq_epi8(_mm256_subs_epu8(s, threshold), _mm256_setzero_si256());
+	return _mm256_andnot_si256(notCorner, _mm256_subs_epu8(s, _mm256_set1_epi8(1)));
+}
+#endif
+
+#if defined(__SSE2__)
+static inline __m128i MaxArcMin(const __m128i d[16])
+{
+	__m128i m2[16], m4[16];
+	for (int k = 0; k < 16; k++)
+		m2[k] = _mm_min_epu8(d[k], d[(k + 1) & 15]);
+	for (int k = 0; k < 16; k++)
+		m4[k] = _mm_min_epu8(m2[k], m2[(k + 2) & 15]);
+
+	__m128i result = _mm_setzero_si128();
+	for (int k = 0; k < 16; k++)
+	{
+		const __m128i m8 = _mm_min_epu8(m4[k], m4[(k + 4) & 15]);
+		result = _mm_max_epu8(result, _mm_min_epu8(m8, d[(k + 8) & 15]));
+	}
+	return result;
+}
+
+static inline __m128i BlockScores(const uchar* ptr, const int pixel[25], __m128i c, __m128i threshold)
+{
+	__m128i b[16], d[16];
+	for (int k = 0; k < 16; k++)
+	{
+		const __m128i p = _mm_loadu_si128(reinterpret_cast<const __m128i*>(ptr + pixel[k]));
+		b[k] = _mm_subs_epu8(p, c);
+		d[k] = _mm_subs_epu8(c, p);
+	}
+	const __m128i s = _mm_max_epu8(MaxArcMin(b), MaxArcMin(d));
+
+	const __m128i notCorner = _mm_cmpeq_epi8(_mm_subs_epu8(s, threshold), _mm_setzero_si128());
+	return _mm_andnot_si128(notCorner, _mm_subs_epu8(s, _mm_set1_epi8(1)));
+}
+#elif defined(__ARM_NEON)
+static inline uint8x16_t CornerMask(const uchar* ptr, const int pixel[25], uint8x16_t hi, uint8x16_t lo)
+{
+	uint8x16_t c0 = vdupq_n_u8(0), c1 = c0, max0 = c0, max1 = c0;
+	for (int k = 0; k < 25; k++)
+	{
+		const uint8x16_t x = vld1q_u8(ptr + pixel[k]);
+		const uint8x16_t m0 = vcgtq_u8(x, hi);
+		const uint8x16_t m1 = vcltq_u8(x, lo);
+		c0 = vandq_u8(vsubq_u8(c0, m0), m0);
+		c1 = vandq_u8(vsubq_u8(c1, m1), m1);
+		max0 = vmaxq_u8(max0, c0);
+		max1 = vmaxq_u8(max1, c1);
+	}
+	return vcgtq_u8(vmaxq_u8(max0, max1), vdupq_n_u8(8));
+}
+#endif
+
+// Scores the pixels src[0..n) of a row.
+// Blocks of pixels are first checked on the compass points, then scored together.
+// Pixels where valid is zero are skipped (valid may be null).
+static void ScoreRow(const uchar* src, const uchar* valid, uchar* dst, int n, const int pixel[25], int threshold)
+{
+	int x = 0;
+
+#if defined(__AVX2__)
+	const __m256i t32 = _mm256_set1_epi8(static_cast<char>(threshold));
+	const __m256i zero32 = _mm256_setzero_si256();
+	for (; x <= n - 32; x += 32)
+	{
+		const uchar* ptr = src + x;
+		const __m256i c = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(ptr));
+		const __m256i hi = _mm256_adds_epu8(c, t32);
+		const __m256i lo = _mm256_subs_epu8(c, t32);
+
+		__m256i b[4], d[4];
+		for (int k = 0; k < 4; k++)
+		{
+			const __m256i p = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(ptr + pixel[4 * k]));
+			b[k] = _mm256_subs_epu8(p, hi); // non zero if brighter
+			d[k] = _mm256_subs_epu8(lo, p); // non zero if darker
+		}
+
+		__m256i candidate = zero32;
+		for (int k = 0; k < 4; k++)
+		{
+			candidate = _mm256_max_epu8(candidate, _mm256_min_epu8(b[k], b[(k + 1) & 3]));
+			candidate = _mm256_max_epu8(candidate, _mm256_min_epu8(d[k], d[(k + 1) & 3]));
+		}
+
+		__m256i invalid = zero32;
+		if (valid)
+			invalid = _mm256_cmpeq_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(valid + x)), zero32);
+
+		__m256i scores = zero32;
+		if (_mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(candidate, zero32), invalid)) != -1)
+			scores = _mm256_andnot_si256(invalid, BlockScores(ptr, pixel, c, t32));
+
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + x), scores);
+	}
+#endif
+
+#if defined(__SSE2__)
+	const __m128i t16 = _mm_set1_epi8(static_cast<char>(threshold));
+	const __m128i zero16 = _mm_setzero_si128();
+	for (; x <= n - 16; x += 16)
+	{
+		const uchar* ptr = src + x;
+		const __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(ptr));
+		const __m128i hi = _mm_adds_epu8(c, t16);
+		const __m128i lo = _mm_subs_epu8(c, t16);
+
+		__m128i b[4], d[4];
+		for (int k = 0; k < 4; k++)
+		{
+			const __m128i p = _mm_loadu_si128(reinterpret_cast<const __m128i*>(ptr + pixel[4 * k]));
+			b[k] = _mm_subs_epu8(p, hi);
+			d[k] = _mm_subs_epu8(lo, p);
+		}
+
+		__m128i candidate = zero16;
+		for (int k = 0; k < 4; k++)
+		{
+			candidate = _mm_max_epu8(candidate, _mm_min_epu8(b[k], b[(k + 1) & 3]));
+			candidate = _mm_max_epu8(candidate, _mm_min_epu8(d[k], d[(k + 1) & 3]));
+		}
+
+		__m128i invalid = zero16;
+		if (valid)
+			invalid = _mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(valid + x)), zero16);
+
+		__m128i scores = zero16;
+		if (_mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(candidate, zero16), invalid)) != 0xffff)
+			scores = _mm_andnot_si128(invalid, BlockScores(ptr, pixel, c, t16));
+
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + x), scores);
+	}
+#elif defined(__ARM_NEON)
+	const uint8x16_t t16 = vdupq_n_u8(static_cast<uint8_t>(threshold));
+	for (; x <= n - 16; x += 16)
+	{
+		const uchar* ptr = src + x;
+		const uint8x16_t c = vld1q_u8(ptr);
+		const uint8x16_t hi = vqaddq_u8(c, t16);
+		const uint8x16_t lo = vqsubq_u8(c, t16);
+
+		vst1q_u8(dst + x, vdupq_n_u8(0));
+
+		uchar flags[16];
+		vst1q_u8(flags, CornerMask(ptr, pixel, hi, lo));
+		for (int i = 0; i < 16; i++)
+			if (flags[i] && (!valid || valid[x + i]))
+				ScorePixel(ptr + i, pixel, threshold, dst + x + i);
+	}
+#endif
+
+	for (; x < n; x++)
+	{
+		dst[x] = 0;
+		if ((!valid || valid[x]) && IsCandidate(src + x, pixel, threshold))
+			ScorePixel(src + x, pixel, threshold, dst + x);
+	}
+}
+
+void ComputeFASTScores(const cv::Mat& image, const cv::Rect& roi, int threshold, cv::Mat& scores, const cv::Mat& mask)
+{
+	CV_Assert(image.type() == CV_8U && scores.type() == CV_8U && scores.size() == image.size());
+	CV_Assert(mask.empty() || (mask.type() == CV_8U && mask.size() == image.size()));
+	CV_Assert(roi.x >= FAST_RADIUS && roi.y >= FAST_RADIUS &&
+		roi.x + roi.width <= image.cols - FAST_RADIUS && roi.y + roi.height <= image.rows - FAST_RADIUS);
+
+	threshold = std::min(std::max(threshold, 1), 255);
+
+	int pixel[25];
+	MakeOffsets(pixel, static_cast<int>(image.step));
+
+	for (int y = roi.y; y < roi.y + roi.height; y++)
+		ScoreRow(image.ptr<uchar>(y) + roi.x, mask.empty() ? nullptr : mask.ptr<uchar>(y) + roi.x,
+			scores.ptr<uchar>(y) + roi.x, roi.width, pixel, threshold);
+}
+
+void FASTNonMaxSuppression(const cv::Mat& scores, const cv::Rect& roi, int threshold, KeyPoints& keypoints)
+{
+	CV_Assert(scores.type() == CV_8U);
+	CV_Assert(roi.x >= 1 && roi.y >= 1 && roi.x + roi.width < scores.cols && roi.y + roi.height < scores.rows);
+
+	threshold = std::min(std::max(threshold, 1), 255);
+
+	const int step = static_cast<int>(scores.step);
+	const int minx = roi.x;
+	const int maxx = roi.x + roi.width;
+
+	for (int y = roi.y; y < roi.y + roi.height; y++)
+	{
+		const uchar* row = scores.ptr<uchar>(y);
+		int x = minx;
+#if defined(__SSE2__)
+		// The maxima of 16 pixels at once: scores >= threshold and greater than the highest of the 8 neighbors
+		const __m128i t16 = _mm_set1_epi8(static_cast<char>(threshold - 1));
+		const __m128i zero16 = _mm_setzero_si128();
+		for (; x + 16 <= maxx; x += 16)
+		{
+			const uchar* ptr = row + x;
+			const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(ptr));
+			const __m128i below = _mm_cmpeq_epi8(_mm_subs_epu8(v, t16), zero16);
+			if (_mm_movemask_epi8(below) == 0xffff)
+				continue;
+
+			const auto load = [ptr](int offset) { return _mm_loadu_si128(reinterpret_cast<const __m128i*>(ptr + offset)); };
+			__m128i neighbors = _mm_max_epu8(load(-1), load(1));
+			neighbors = _mm_max_epu8(neighbors, _mm_max_epu8(load(-step - 1), load(-step)));
+			neighbors = _mm_max_epu8(neighbors, _mm_max_epu8(load(-step + 1), load(step - 1)));
+			neighbors = _mm_max_epu8(neighbors, _mm_max_epu8(load(step), load(step + 1)));
+			const __m128i notMax = _mm_or_si128(below, _mm_cmpeq_epi8(_mm_subs_epu8(v, neighbors), zero16));
+
+			uint32_t mask = ~static_cast<uint32_t>(_mm_movemask_epi8(notMax)) & 0xffff;
+			while (mask)
+			{
+				const int i = CountTrailingZeros(mask);
+				mask &= mask - 1;
+				keypoints.push_back(cv::KeyPoint(static_cast<float>(x + i), static_cast<float>(y), 7.f, -1.f,
+					static_cast<float>(ptr[i])));
+			}
+		}
+#endif
+		for (; x < maxx; x++)
+		{
+			const uchar* ptr = row + x;
+			const int score = ptr[0];
+			if (score < threshold)
+				continue;
+
+			if (score > ptr[-1] && score > ptr[1] &&
+				score > ptr[-step - 1] && score > ptr[-step] && score > ptr[-step + 1] &&
+				score > ptr[step - 1] && score > ptr[step] && score > ptr[step + 1])
+			{
+				keypoints.push_back(cv::KeyPoint(static_cast<float>(x), static_cast<float>(y), 7.f, -1.f,
+					static_cast<float>(score)));
+			}
+		}
+	}
+}
+
+} // namespace ORB_SLAM2
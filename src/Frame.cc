@@ -61,7 +61,7 @@ bool ImageBounds::Empty() const
 //////////////////////////////////////////////////////////////////////////////////
 // FeaturesGrid Class
 //////////////////////////////////////////////////////////////////////////////////
-FeaturesGrid::FeaturesGrid() {}
+FeaturesGrid::FeaturesGrid() : invW_(0.f), invH_(0.f), nlevels_(0) {}
 
 FeaturesGrid::FeaturesGrid(const KeyPoints& keypoints, const ImageBounds& imageBounds, int nlevels)
 {
@@ -73,16 +73,15 @@ void FeaturesGrid::AssignFeatures(const KeyPoints& keypoints, const ImageBounds&
 	invW_ = COLS / imageBounds.Width();
 	invH_ = ROWS / imageBounds.Height();
 
-	keypoints_ = keypoints;
 	imageBounds_ = imageBounds;
 	nlevels_ = nlevels;
 
 	const int nkeypoints = static_cast<int>(keypoints.size());
+	const int nbins = COLS * ROWS * (nlevels + 1);
 
-	const int nreserve = nkeypoints / (COLS * ROWS) / 2;
-	for (unsigned int i = 0; i < COLS; i++)
-		for (unsigned int j = 0; j < ROWS; j++)
-			grid_[i][j].reserve(nreserve);
+	// Bin (cell and level) of each keypoint, counted in levelOffsets_[bin + 1]
+	std::vector<int> bins(nkeypoints, -1);
+	levelOffsets_.assign(nbins + 1, 0);
 
 	for (int i = 0; i < nkeypoints; i++)
 	{
@@ -95,53 +94,64 @@ void FeaturesGrid::AssignFeatures(const KeyPoints& keypoints, const ImageBounds&
 		if (cx < 0 || cx >= COLS || cy < 0 || cy >= ROWS)
 			continue;
 
-		grid_[cx][cy].push_back(i);
+		const int level = std::min(std::max(keypoint.octave, 0), nlevels - 1);
+		bins[i] = (cx * ROWS + cy) * (nlevels + 1) + level;
+		levelOffsets_[bins[i] + 1]++;
+	}
+
+	for (int bin = 0; bin < nbins; bin++)
+		levelOffsets_[bin + 1] += levelOffsets_[bin];
+
+	// Keypoints are stored in increasing index order within each bin
+	const int nassigned = levelOffsets_[nbins];
+	indices_.resize(nassigned);
+	points_.resize(nassigned);
+
+	std::vector<int> positions(std::begin(levelOffsets_), std::end(levelOffsets_) - 1);
+	for (int i = 0; i < nkeypoints; i++)
+	{
+		if (bins[i] < 0)
+			continue;
+
+		const int k = positions[bins[i]]++;
+		indices_[k] = i;
+		points_[k] = keypoints[i].pt;
 	}
 }
 
-std::vector<size_t> FeaturesGrid::GetFeaturesInArea(float x, float y, float r, int minLevel, int maxLevel) const
+bool FeaturesGrid::GetCellRange(float x, float y, float r, int& mincx, int& maxcx, int& mincy, int& maxcy) const
 {
-	const int nkeypoints = static_cast<int>(keypoints_.size());
-
-	std::vector<size_t> indices;
-	indices.reserve(nkeypoints);
+	if (levelOffsets_.empty())
+		return false;
 
 	const float minx = imageBounds_.minx;
 	const float miny = imageBounds_.miny;
 
-	const int mincx = std::max(RoundDn(invW_ * (x - r - minx)), 0);
-	const int maxcx = std::min(RoundUp(invW_ * (x + r - minx)), COLS - 1);
-	const int mincy = std::max(RoundDn(invH_ * (y - r - miny)), 0);
-	const int maxcy = std::min(RoundUp(invH_ * (y + r - miny)), ROWS - 1);
+	mincx = std::max(RoundDn(invW_ * (x - r - minx)), 0);
+	maxcx = std::min(RoundUp(invW_ * (x + r - minx)), COLS - 1);
+	mincy = std::max(RoundDn(invH_ * (y - r - miny)), 0);
+	maxcy = std::min(RoundUp(invH_ * (y + r - miny)), ROWS - 1);
 
-	if (mincx >= COLS || maxcx < 0 || mincy >= ROWS || maxcy < 0)
-		return indices;
+	return !(mincx >= COLS || maxcx < 0 || mincy >= ROWS || maxcy < 0);
+}
 
-	const bool checkLevels = (minLevel > 0) || (maxLevel >= 0);
-	if (maxLevel < 0)
-		maxLevel = nlevels_;
+std::vector<size_t> FeaturesGrid::GetFeaturesInArea(float x, float y, float r, int minLevel, int maxLevel) const
+{
+	std::vector<size_t> indices;
+	GetFeaturesInArea(x, y, r, minLevel, maxLevel, indices);
+	return indices;
+}
 
-	for (int cx = mincx; cx <= maxcx; cx++)
-	{
-		for (int cy = mincy; cy <= maxcy; cy++)
-		{
-			for (size_t idx : grid_[cx][cy])
-			{
-				const cv::KeyPoint& keypoint = keypoints_[idx];
-				const int level = keypoint.octave;
-				if (checkLevels && (level < minLevel || level > maxLevel))
-					continue;
-
-				const float distx = keypoint.pt.x - x;
-				const float disty = keypoint.pt.y - y;
-
-				if (fabsf(distx) < r && fabsf(disty) < r)
-					indices.push_back(idx);
-			}
-		}
-	}
+void FeaturesGrid::GetFeaturesInArea(float x, float y, float r, int minLevel, int maxLevel, std::vector<size_t>& indices) const
+{
+	ForEachFeatureInArea(x, y, r, minLevel, maxLevel, [&](size_t idx) { indices.push_back(idx); });
+}
 
-	return indices;
+int FeaturesGrid::GetCellIndex(float x, float y) const
+{
+	const int cx = std::min(std::max(Round(invW_ * (x - imageBounds_.minx)), 0), COLS - 1);
+	const int cy = std::min(std::max(Round(invH_ * (y - imageBounds_.miny)), 0), ROWS - 1);
+	return cy * COLS + cx;
 }
 
 Frame::Frame() {}
@@ -150,7 +160,7 @@ Frame::Frame() {}
 Frame::Frame(const Frame& frame)
 	: voc(frame.voc), timestamp(frame.timestamp), camera(frame.camera), N(frame.N),
 	keypoints(frame.keypoints), keypointsUn(frame.keypointsUn), uright(frame.uright), depth(frame.depth),
-	bowVector(frame.bowVector), featureVector(frame.featureVector), descriptors(frame.descriptors.clone()),
+	bowVector(frame.bowVector), featureVector(frame.featureVector), descriptors(frame.descriptors),
 	mappoints(frame.mappoints), outlier(frame.outlier), grid(frame.grid), id(frame.id), referenceKF(frame.referenceKF),
 	pyramid(frame.pyramid), imageBounds(frame.imageBounds)
 {
@@ -162,7 +172,7 @@ Frame::Frame(ORBVocabulary* voc, double timestamp, const CameraParams& camera, c
 	const KeyPoints& keypointsUn, const std::vector<float>& uright, const std::vector<float>& depth,
 	const cv::Mat& descriptors, const ScalePyramidInfo& pyramid, const ImageBounds& imageBounds)
 	: voc(voc), timestamp(timestamp), camera(camera), keypoints(keypoints), keypointsUn(keypointsUn), uright(uright),
-	depth(depth), descriptors(descriptors.clone()), referenceKF(nullptr), pyramid(pyramid), imageBounds(imageBounds)
+	depth(depth), descriptors(ToDescriptors(descriptors)), referenceKF(nullptr), pyramid(pyramid), imageBounds(imageBounds)
 {
 	// Frame ID
 	id = nextId++;
@@ -178,7 +188,7 @@ Frame::Frame(ORBVocabulary* voc, double timestamp, const CameraParams& camera, c
 Frame::Frame(ORBVocabulary* voc, double timestamp, const CameraParams& camera, const KeyPoints& keypoints,
 	const KeyPoints& keypointsUn, const cv::Mat& descriptors, const ScalePyramidInfo& pyramid, const ImageBounds& imageBounds)
 	: voc(voc), timestamp(timestamp), camera(camera), keypoints(keypoints), keypointsUn(keypointsUn),
-	descriptors(descriptors.clone()), referenceKF(nullptr), pyramid(pyramid), imageBounds(imageBounds)
+	descriptors(ToDescriptors(descriptors)), referenceKF(nullptr), pyramid(pyramid), imageBounds(imageBounds)
 {
 	// Frame ID
 	id = nextId++;
@@ -210,7 +220,7 @@ void Frame::ComputeBoW()
 	if (!bowVector.empty())
 		return;
 
-	voc->transform(Converter::toDescriptorVector(descriptors), bowVector, featureVector, 4);
+	voc->transform(Converter::toDescriptorVector(ToMat(descriptors)), bowVector, featureVector, 4);
 }
 
 std::vector<size_t> Frame::GetFeaturesInArea(float x, float y, float r, int minLevel, int maxLevel) const
@@ -218,6 +228,11 @@ std::vector<size_t> Frame::GetFeaturesInArea(float x, float y, float r, int minL
 	return grid.GetFeaturesInArea(x, y, r, minLevel, maxLevel);
 }
 
+void Frame::GetFeaturesInArea(float x, float y, float r, int minLevel, int maxLevel, std::vector<size_t>& indices) const
+{
+	grid.GetFeaturesInArea(x, y, r, minLevel, maxLevel, indices);
+}
+
 Point3D Frame::UnprojectStereo(int i) const
 {
 	const float Zc = depth[i];
@@ -53,7 +53,7 @@ KeyFrame::KeyFrame(const Frame& frame, Map* map, KeyFrameDatabase* keyframeDB) :
 	trackReferenceForFrame(0), fuseTargetForKF(0), BALocalForKF(0), BAFixedForKF(0),
 	loopQuery(0), loopWords(0), relocQuery(0), relocWords(0), BAGlobalForKF(0),
 	camera(frame.camera), N(frame.N), keypointsL(frame.keypoints), keypointsUn(frame.keypointsUn),
-	uright(frame.uright), depth(frame.depth), descriptorsL(frame.descriptors.clone()),
+	uright(frame.uright), depth(frame.depth), descriptorsL(frame.descriptors),
 	bowVector(frame.bowVector), featureVector(frame.featureVector), pyramid(frame.pyramid), imageBounds(frame.imageBounds),
 	mappoints_(frame.mappoints), keyFrameDB_(keyframeDB),
 	voc_(frame.voc), firstConnection_(true), parent_(nullptr), notErase_(false),
@@ -70,7 +70,7 @@ void KeyFrame::ComputeBoW()
 
 	// Feature vector associate features with nodes in the 4th level (from leaves up)
 	// We assume the vocabulary tree has 6 levels, change the 4 otherwise
-	voc_->transform(Converter::toDescriptorVector(descriptorsL), bowVector, featureVector, 4);
+	voc_->transform(Converter::toDescriptorVector(ToMat(descriptorsL)), bowVector, featureVector, 4);
 }
 
 void KeyFrame::SetPose(const CameraPose& pose)
@@ -493,6 +493,11 @@ std::vector<size_t> KeyFrame::GetFeaturesInArea(float x, float y, float r) const
 	return grid.GetFeaturesInArea(x, y, r);
 }
 
+void KeyFrame::GetFeaturesInArea(float x, float y, float r, std::vector<size_t>& indices) const
+{
+	grid.GetFeaturesInArea(x, y, r, -1, -1, indices);
+}
+
 bool KeyFrame::IsInImage(float x, float y) const
 {
 	return imageBounds.Contains(x, y);
@@ -21,15 +21,17 @@
 #include "LocalMapping.h"
 
 #include <mutex>
+#include <condition_variable>
+#include <limits>
 
 #include "Tracking.h"
 #include "LoopClosing.h"
 #include "ORBmatcher.h"
-#include "Usleep.h"
 #include "KeyFrame.h"
 #include "Map.h"
 #include "Optimizer.h"
 #include "CameraProjection.h"
+#include "ThreadPool.h"
 
 #define LOCK_MUTEX_NEW_KF()    std::unique_lock<std::mutex> lock1(mutexNewKFs_);
 #define LOCK_MUTEX_RESET()     std::unique_lock<std::mutex> lock2(mutexReset_);
@@ -40,6 +42,21 @@
 namespace ORB_SLAM2
 {
 
+// Runs func(i) for i in [0, n) on the thread pool, or serially if there is none.
+// The pool is shared with the tracking, whose work is served first.
+template <class Func>
+static void ParallelFor(ThreadPool* pool, int n, const Func& func)
+{
+	if (pool)
+	{
+		pool->ParallelFor(n, func, ThreadPool::PRIORITY_LOW);
+		return;
+	}
+
+	for (int i = 0; i < n; i++)
+		func(i);
+}
+
 static inline cv::Matx33f SkewSymmetricMatrix(const Vec3D& v)
 {
 	const float x = v(0);
@@ -70,13 +87,82 @@ static cv::Mat ComputeF12(KeyFrame* keyframe1, KeyFrame* keyframe2)
 	return cv::Mat(K1.t().inv() * t12x * R12 * K2.inv());
 }
 
+// Depths of the closest points of the rays O1 + depth1 * ray1 and O2 + depth2 * ray2 (midpoint method).
+// With rays of normalized coordinates rotated to the world, these are the depths in each camera.
+static bool RayDepths(const Point3D& O1, const Vec3D& ray1, const Point3D& O2, const Vec3D& ray2, float& depth1, float& depth2)
+{
+	const Vec3D O12 = O2 - O1;
+	const float a = ray1.dot(ray1);
+	const float b = ray1.dot(ray2);
+	const float c = ray2.dot(ray2);
+	const float d = ray1.dot(O12);
+	const float e = ray2.dot(O12);
+
+	const float denom = a * c - b * b;
+	if (denom <= 0)
+		return false;
+
+	depth1 = (c * d - b * e) / denom;
+	depth2 = (b * d - a * e) / denom;
+	return true;
+}
+
+// Adds the DLT equation x * Tcw.row(2) - Tcw.row(r) to the normal equations, with the homogeneous coordinate set to 1
+static inline void AddTriangulationEquation(float x, const CameraPose& pose, int r, cv::Matx33d& AtA, cv::Vec3d& Atb)
+{
+	const auto& R = pose.R();
+	const auto& t = pose.t();
+	const cv::Vec3d a(x * R(2, 0) - R(r, 0), x * R(2, 1) - R(r, 1), x * R(2, 2) - R(r, 2));
+	const double b = t(r) - x * t(2);
+
+	for (int i = 0; i < 3; i++)
+	{
+		for (int j = 0; j < 3; j++)
+			AtA(i, j) += a[i] * a[j];
+		Atb[i] += a[i] * b;
+	}
+}
+
+// Linear triangulation of the normalized coordinates xn1 and xn2.
+// Solves the 4x3 least squares of the DLT with the homogeneous coordinate set to 1 in closed form,
+// which is as accurate as the SVD of the 4x4 system for the points with enough parallax.
+static bool TriangulateLinear(const Vec3D& xn1, const CameraPose& pose1, const Vec3D& xn2, const CameraPose& pose2, Point3D& Xw)
+{
+	cv::Matx33d M = cv::Matx33d::zeros();
+	cv::Vec3d y(0, 0, 0);
+	AddTriangulationEquation(xn1(0), pose1, 0, M, y);
+	AddTriangulationEquation(xn1(1), pose1, 1, M, y);
+	AddTriangulationEquation(xn2(0), pose2, 0, M, y);
+	AddTriangulationEquation(xn2(1), pose2, 1, M, y);
+
+	// Inverse of the symmetric matrix by its cofactors
+	const double c00 = M(1, 1) * M(2, 2) - M(1, 2) * M(1, 2);
+	const double c01 = M(0, 2) * M(1, 2) - M(0, 1) * M(2, 2);
+	const double c02 = M(0, 1) * M(1, 2) - M(0, 2) * M(1, 1);
+	const double c11 = M(0, 0) * M(2, 2) - M(0, 2) * M(0, 2);
+	const double c12 = M(0, 1) * M(0, 2) - M(0, 0) * M(1, 2);
+	const double c22 = M(0, 0) * M(1, 1) - M(0, 1) * M(0, 1);
+
+	const double det = M(0, 0) * c00 + M(0, 1) * c01 + M(0, 2) * c02;
+	const double trace = M(0, 0) + M(1, 1) + M(2, 2);
+	if (det <= std::numeric_limits<double>::epsilon() * trace * trace * trace)
+		return false;
+
+	const double invDet = 1. / det;
+	Xw(0) = static_cast<float>(invDet * (c00 * y[0] + c01 * y[1] + c02 * y[2]));
+	Xw(1) = static_cast<float>(invDet * (c01 * y[0] + c11 * y[1] + c12 * y[2]));
+	Xw(2) = static_cast<float>(invDet * (c02 * y[0] + c12 * y[1] + c22 * y[2]));
+	return true;
+}
+
 class LocalMappingImpl : public LocalMapping
 {
 public:
 
-	LocalMappingImpl(Map* map, bool monocular, float thDepth) :
+	LocalMappingImpl(Map* map, bool monocular, float thDepth, ThreadPool* pool) :
 		monocular_(monocular), resetRequested_(false), finishRequested_(false), finished_(true), map_(map),
-		abortBA_(false), stopped_(false), stopRequested_(false), notStop_(false), acceptKeyFrames_(true), thDepth_(thDepth)
+		abortBA_(false), stopped_(false), stopRequested_(false), notStop_(false), acceptKeyFrames_(true), thDepth_(thDepth),
+		pool_(pool)
 	{
 	}
 
@@ -147,10 +233,7 @@ public:
 			else if (Stop())
 			{
 				// Safe area to stop
-				while (isStopped() && !CheckFinish())
-				{
-					usleep(3000);
-				}
+				WaitFor([this]() { return !isStopped() || CheckFinish(); });
 				if (CheckFinish())
 					break;
 			}
@@ -163,7 +246,8 @@ public:
 			if (CheckFinish())
 				break;
 
-			usleep(3000);
+			// Sleep until there is something to do
+			WaitFor([this]() { return CheckNewKeyFrames() || CheckStop() || CheckReset() || CheckFinish(); });
 		}
 
 		SetFinish();
@@ -171,18 +255,24 @@ public:
 
 	void InsertKeyFrame(KeyFrame* keyframe) override
 	{
-		LOCK_MUTEX_NEW_KF();
-		newKeyFrames_.push_back(keyframe);
-		abortBA_ = true;
+		{
+			LOCK_MUTEX_NEW_KF();
+			newKeyFrames_.push_back(keyframe);
+			abortBA_ = true;
+		}
+		Notify();
 	}
 
 	// Thread Synch
 	void RequestStop() override
 	{
-		LOCK_MUTEX_STOP();
-		stopRequested_ = true;
-		LOCK_MUTEX_NEW_KF();
-		abortBA_ = true;
+		{
+			LOCK_MUTEX_STOP();
+			stopRequested_ = true;
+			LOCK_MUTEX_NEW_KF();
+			abortBA_ = true;
+		}
+		Notify();
 	}
 
 	void RequestReset() override
@@ -191,46 +281,48 @@ public:
 			LOCK_MUTEX_RESET();
 			resetRequested_ = true;
 		}
+		Notify();
 
-		while (true)
-		{
-			{
-				LOCK_MUTEX_RESET();
-				if (!resetRequested_)
-					break;
-			}
-			usleep(3000);
-		}
+		WaitFor([this]() { return !CheckReset(); });
 	}
 
 	bool Stop() override
 	{
-		LOCK_MUTEX_STOP();
-		if (stopRequested_ && !notStop_)
 		{
+			LOCK_MUTEX_STOP();
+			if (!stopRequested_ || notStop_)
+				return false;
+
 			stopped_ = true;
 			std::cout << "Local Mapping STOP" << std::endl;
-			return true;
 		}
-
-		return false;
+		Notify();
+		return true;
 	}
 
 	void Release() override
 	{
-		LOCK_MUTEX_STOP();
-		LOCK_MUTEX_FINISH();
+		{
+			LOCK_MUTEX_STOP();
+			LOCK_MUTEX_FINISH();
 
-		if (finished_)
-			return;
+			if (finished_)
+				return;
+
+			stopped_ = false;
+			stopRequested_ = false;
+			for (KeyFrame* keyframe : newKeyFrames_)
+				delete keyframe;
+			newKeyFrames_.clear();
 
-		stopped_ = false;
-		stopRequested_ = false;
-		for (KeyFrame* keyframe : newKeyFrames_)
-			delete keyframe;
-		newKeyFrames_.clear();
+			std::cout << "Local Mapping RELEASE" << std::endl;
+		}
+		Notify();
+	}
 
-		std::cout << "Local Mapping RELEASE" << std::endl;
+	void WaitUntilStopped() const override
+	{
+		WaitFor([this]() { return isStopped(); });
 	}
 
 	bool isStopped() const override
@@ -259,12 +351,18 @@ public:
 
 	bool SetNotStop(bool flag) override
 	{
-		LOCK_MUTEX_STOP();
+		{
+			LOCK_MUTEX_STOP();
 
-		if (flag && stopped_)
-			return false;
+			if (flag && stopped_)
+				return false;
 
-		notStop_ = flag;
+			notStop_ = flag;
+		}
+
+		// A pending stop request can be served now
+		if (!flag)
+			Notify();
 
 		return true;
 	}
@@ -276,8 +374,11 @@ public:
 
 	void RequestFinish() override
 	{
-		LOCK_MUTEX_FINISH();
-		finishRequested_ = true;
+		{
+			LOCK_MUTEX_FINISH();
+			finishRequested_ = true;
+		}
+		Notify();
 	}
 
 	bool isFinished() const override
@@ -294,12 +395,43 @@ public:
 
 private:
 
-	bool CheckNewKeyFrames()
+	bool CheckNewKeyFrames() const
 	{
 		LOCK_MUTEX_NEW_KF();
 		return(!newKeyFrames_.empty());
 	}
 
+	// A stop request that Stop() would serve
+	bool CheckStop() const
+	{
+		LOCK_MUTEX_STOP();
+		return stopRequested_ && !notStop_ && !stopped_;
+	}
+
+	bool CheckReset() const
+	{
+		LOCK_MUTEX_RESET();
+		return resetRequested_;
+	}
+
+	// The state is guarded by several mutexes, so the waits use their own one.
+	// The notifiers change the state first, then take mutexWakeup_ before notifying,
+	// so that a waiter cannot miss a change between the check of its predicate and its wait.
+	template <class Predicate>
+	void WaitFor(Predicate predicate) const
+	{
+		std::unique_lock<std::mutex> lock(mutexWakeup_);
+		wakeup_.wait(lock, predicate);
+	}
+
+	void Notify() const
+	{
+		{
+			std::unique_lock<std::mutex> lock(mutexWakeup_);
+		}
+		wakeup_.notify_all();
+	}
+
 	void ProcessNewKeyFrame(KeyFrame* currKeyFrame_)
 	{
 		// Compute Bags of Words structures
@@ -377,203 +509,251 @@ private:
 	static inline float NormSq(float x, float y) { return x * x + y * y; }
 	static inline float NormSq(float x, float y, float z) { return x * x + y * y + z * z; }
 
-	void CreateNewMapPoints(KeyFrame* currKeyFrame_)
+	// A point triangulated from the keypoint idx1 of the current keyframe and the keypoint idx2 of a neighbor
+	struct NewPoint
 	{
-		KeyFrame* keyframe1 = currKeyFrame_;
-
-		// Retrieve neighbor keyframes in covisibility graph
-		const int nneighbors = monocular_ ? 20 : 10;
-		const std::vector<KeyFrame*> neighborKFs = keyframe1->GetBestCovisibilityKeyFrames(nneighbors);
+		Point3D Xw;
+		int idx1;
+		int idx2;
+	};
 
+	// Matches the keypoints without MapPoint of both keyframes and triangulates them. Only reads the map.
+	void TriangulateNewPoints(KeyFrame* keyframe1, KeyFrame* keyframe2, std::vector<NewPoint>& newPoints) const
+	{
 		ORBmatcher matcher(0.6f, false);
 
 		const CameraPose pose1 = keyframe1->GetPose();
 		const CameraProjection proj1(pose1, keyframe1->camera);
 		const CameraUnProjection unproj1(pose1, keyframe1->camera);
 		const Point3D Ow1 = keyframe1->GetCameraCenter();
-		const cv::Mat Tcw1 = pose1.Mat();
 
 		const float ratioFactor = 1.5f * keyframe1->pyramid.scaleFactor;
 
-		// Search matches with epipolar restriction and triangulate
-		for (size_t i = 0; i < neighborKFs.size(); i++)
+		// Check first that baseline is not too short
+		const Point3D Ow2 = keyframe2->GetCameraCenter();
+		const float baseline = static_cast<float>(cv::norm(Ow2 - Ow1));
+
+		if (!monocular_)
 		{
-			if (i > 0 && CheckNewKeyFrames())
+			if (baseline < keyframe2->camera.baseline)
+				return;
+		}
+		else
+		{
+			const float medianDepthKF2 = keyframe2->ComputeSceneMedianDepth(2);
+			const float ratioBaselineDepth = baseline / medianDepthKF2;
+
+			if (ratioBaselineDepth < 0.01f)
 				return;
+		}
+
+		// Compute Fundamental Matrix
+		const cv::Mat F12 = ComputeF12(keyframe1, keyframe2);
+
+		// Search matches that fullfil epipolar constraint
+		std::vector<std::pair<size_t, size_t> > matchIndices;
+		matcher.SearchForTriangulation(keyframe1, keyframe2, F12, matchIndices, false);
+
+		const CameraPose pose2 = keyframe2->GetPose();
+		const CameraProjection proj2(pose2, keyframe2->camera);
+		const CameraUnProjection unproj2(pose2, keyframe2->camera);
 
-			KeyFrame* keyframe2 = neighborKFs[i];
+		// Triangulate each match
+		for (const auto& matchIdx : matchIndices)
+		{
+			const int idx1 = static_cast<int>(matchIdx.first);
+			const int idx2 = static_cast<int>(matchIdx.second);
+
+			const cv::KeyPoint& keypoint1 = keyframe1->keypointsUn[idx1];
+			const cv::KeyPoint& keypoint2 = keyframe2->keypointsUn[idx2];
+			const float ur1 = keyframe1->uright[idx1];
+			const float ur2 = keyframe2->uright[idx2];
+			const float Z1 = keyframe1->depth[idx1];
+			const float Z2 = keyframe2->depth[idx2];
+			const bool stereo1 = ur1 >= 0;
+			const bool stereo2 = ur2 >= 0;
+
+			// Check parallax between rays
+			const Vec3D xn1 = unproj1.uvZToCamera(keypoint1.pt.x, keypoint1.pt.y, 1.f);
+			const Vec3D xn2 = unproj2.uvZToCamera(keypoint2.pt.x, keypoint2.pt.y, 1.f);
+
+			const Vec3D ray1 = unproj1.Rwc * xn1;
+			const Vec3D ray2 = unproj2.Rwc * xn2;
+			const float cosParallaxRays = CosAngle(ray1, ray2);
+
+			float cosParallaxStereo = cosParallaxRays + 1;
+			float cosParallaxStereo1 = cosParallaxStereo;
+			float cosParallaxStereo2 = cosParallaxStereo;
+
+			if (stereo1)
+				cosParallaxStereo1 = cosf(Parallax(keyframe1->camera.baseline, Z1));
+			else if (stereo2)
+				cosParallaxStereo2 = cosf(Parallax(keyframe2->camera.baseline, Z2));
+
+			cosParallaxStereo = std::min(cosParallaxStereo1, cosParallaxStereo2);
+
+			Point3D Xw;
+			if (cosParallaxRays < cosParallaxStereo && cosParallaxRays>0 && (stereo1 || stereo2 || cosParallaxRays < 0.9998))
+			{
+				// Reject the rays that meet behind a camera before solving
+				float depth1, depth2;
+				if (!RayDepths(Ow1, ray1, Ow2, ray2, depth1, depth2) || depth1 <= 0 || depth2 <= 0)
+					continue;
 
-			// Check first that baseline is not too short
-			const Point3D Ow2 = keyframe2->GetCameraCenter();
-			const float baseline = static_cast<float>(cv::norm(Ow2 - Ow1));
+				// Linear Triangulation Method
+				if (!TriangulateLinear(xn1, pose1, xn2, pose2, Xw))
+					continue;
+			}
+			else if (stereo1 && cosParallaxStereo1 < cosParallaxStereo2)
+			{
+				Xw = unproj1.uvZToWorld(keypoint1.pt, Z1);
+			}
+			else if (stereo2 && cosParallaxStereo2 < cosParallaxStereo1)
+			{
+				Xw = unproj2.uvZToWorld(keypoint2.pt, Z2);
+			}
+			else
+				continue; //No stereo and very low parallax
 
-			if (!monocular_)
+			// Check triangulation in front of cameras
+			const Point3D Xc1 = proj1.WorldToCamera(Xw);
+			const Point3D Xc2 = proj2.WorldToCamera(Xw);
+			if (Xc1(2) <= 0 || Xc2(2) <= 0)
+				continue;
+
+			// Check reprojection error in first keyframe
+			const float sigmaSq1 = keyframe1->pyramid.sigmaSq[keypoint1.octave];
+			const Point2D pt1 = proj1.CameraToImage(Xc1);
+			const Point2D diff1 = pt1 - keypoint1.pt;
+			if (!stereo1)
 			{
-				if (baseline < keyframe2->camera.baseline)
+				if (NormSq(diff1.x, diff1.y) > 5.991 * sigmaSq1)
 					continue;
 			}
 			else
 			{
-				const float medianDepthKF2 = keyframe2->ComputeSceneMedianDepth(2);
-				const float ratioBaselineDepth = baseline / medianDepthKF2;
-
-				if (ratioBaselineDepth < 0.01f)
+				const float d1 = proj1.DepthToDisparity(Xc1(2));
+				const float diff1z = (pt1.x - d1) - ur1;
+				if (NormSq(diff1.x, diff1.y, diff1z) > 7.8 * sigmaSq1)
 					continue;
 			}
 
-			// Compute Fundamental Matrix
-			const cv::Mat F12 = ComputeF12(keyframe1, keyframe2);
+			// Check reprojection error in second keyframe
+			const float sigmaSq2 = keyframe2->pyramid.sigmaSq[keypoint2.octave];
+			const Point2D pt2 = proj2.CameraToImage(Xc2);
+			const Point2D diff2 = pt2 - keypoint2.pt;
+			if (!stereo2)
+			{
+				if (NormSq(diff2.x, diff2.y) > 5.991 * sigmaSq2)
+					continue;
+			}
+			else
+			{
+				const float d2 = proj2.DepthToDisparity(Xc2(2));
+				const float diff2z = (pt2.x - d2) - ur2;
+				if (NormSq(diff2.x, diff2.y, diff2z) > 7.8 * sigmaSq2)
+					continue;
+			}
 
-			// Search matches that fullfil epipolar constraint
-			std::vector<std::pair<size_t, size_t> > matchIndices;
-			matcher.SearchForTriangulation(keyframe1, keyframe2, F12, matchIndices, false);
+			//Check scale consistency
+			const Vec3D normal1 = Xw - Ow1;
+			const float dist1 = static_cast<float>(cv::norm(normal1));
 
-			const CameraPose pose2 = keyframe2->GetPose();
-			const CameraProjection proj2(pose2, keyframe2->camera);
-			const CameraUnProjection unproj2(pose2, keyframe2->camera);
-			const cv::Mat Tcw2 = pose2.Mat();
+			const Vec3D normal2 = Xw - Ow2;
+			const float dist2 = static_cast<float>(cv::norm(normal2));
 
-			// Triangulate each match
-			for (const auto& matchIdx : matchIndices)
-			{
-				const int idx1 = static_cast<int>(matchIdx.first);
-				const int idx2 = static_cast<int>(matchIdx.second);
-
-				const cv::KeyPoint& keypoint1 = keyframe1->keypointsUn[idx1];
-				const cv::KeyPoint& keypoint2 = keyframe2->keypointsUn[idx2];
-				const float ur1 = keyframe1->uright[idx1];
-				const float ur2 = keyframe2->uright[idx2];
-				const float Z1 = keyframe1->depth[idx1];
-				const float Z2 = keyframe2->depth[idx2];
-				const bool stereo1 = ur1 >= 0;
-				const bool stereo2 = ur2 >= 0;
-
-				// Check parallax between rays
-				const Vec3D xn1 = unproj1.uvZToCamera(keypoint1.pt.x, keypoint1.pt.y, 1.f);
-				const Vec3D xn2 = unproj2.uvZToCamera(keypoint2.pt.x, keypoint2.pt.y, 1.f);
-
-				const Vec3D ray1 = unproj1.Rwc * xn1;
-				const Vec3D ray2 = unproj2.Rwc * xn2;
-				const float cosParallaxRays = CosAngle(ray1, ray2);
-
-				float cosParallaxStereo = cosParallaxRays + 1;
-				float cosParallaxStereo1 = cosParallaxStereo;
-				float cosParallaxStereo2 = cosParallaxStereo;
-
-				if (stereo1)
-					cosParallaxStereo1 = cosf(Parallax(keyframe1->camera.baseline, Z1));
-				else if (stereo2)
-					cosParallaxStereo2 = cosf(Parallax(keyframe2->camera.baseline, Z2));
-
-				cosParallaxStereo = std::min(cosParallaxStereo1, cosParallaxStereo2);
-
-				Point3D Xw;
-				if (cosParallaxRays < cosParallaxStereo && cosParallaxRays>0 && (stereo1 || stereo2 || cosParallaxRays < 0.9998))
-				{
-					// Linear Triangulation Method
-					cv::Mat A(4, 4, CV_32F);
-					A.row(0) = xn1(0) * Tcw1.row(2) - Tcw1.row(0);
-					A.row(1) = xn1(1) * Tcw1.row(2) - Tcw1.row(1);
-					A.row(2) = xn2(0) * Tcw2.row(2) - Tcw2.row(0);
-					A.row(3) = xn2(1) * Tcw2.row(2) - Tcw2.row(1);
+			if (dist1 == 0 || dist2 == 0)
+				continue;
 
-					cv::Mat w, u, vt;
-					cv::SVD::compute(A, w, u, vt, cv::SVD::MODIFY_A | cv::SVD::FULL_UV);
+			const float ratioDist = dist2 / dist1;
+			const float scale1 = keyframe1->pyramid.scaleFactors[keypoint1.octave];
+			const float scale2 = keyframe2->pyramid.scaleFactors[keypoint2.octave];
+			const float ratioOctave = scale1 / scale2;
 
-					cv::Mat1f v = vt.row(3).t();
+			if (ratioDist * ratioFactor < ratioOctave || ratioDist > ratioOctave * ratioFactor)
+				continue;
 
-					if (v(3) == 0)
-						continue;
+			// Triangulation is succesfull
+			newPoints.push_back({ Xw, idx1, idx2 });
+		}
+	}
 
-					// Euclidean coordinates
-					const double denom = 1. / v(3);
-					Xw = denom * Point3D(v(0), v(1), v(2));
+	void AddNewMapPoints(KeyFrame* keyframe1, KeyFrame* keyframe2, const std::vector<NewPoint>& newPoints)
+	{
+		for (const NewPoint& newPoint : newPoints)
+		{
+			const int idx1 = newPoint.idx1;
+			const int idx2 = newPoint.idx2;
 
-				}
-				else if (stereo1 && cosParallaxStereo1 < cosParallaxStereo2)
-				{
-					Xw = unproj1.uvZToWorld(keypoint1.pt, Z1);
-				}
-				else if (stereo2 && cosParallaxStereo2 < cosParallaxStereo1)
-				{
-					Xw = unproj2.uvZToWorld(keypoint2.pt, Z2);
-				}
-				else
-					continue; //No stereo and very low parallax
+			// The keypoints may have been triangulated with another neighbor processed concurrently
+			if (keyframe1->GetMapPoint(idx1) || keyframe2->GetMapPoint(idx2))
+				continue;
 
-				// Check triangulation in front of cameras
-				const Point3D Xc1 = proj1.WorldToCamera(Xw);
-				const Point3D Xc2 = proj2.WorldToCamera(Xw);
-				if (Xc1(2) <= 0 || Xc2(2) <= 0)
-					continue;
+			MapPoint* mappoint = new MapPoint(newPoint.Xw, keyframe1, map_);
 
-				// Check reprojection error in first keyframe
-				const float sigmaSq1 = keyframe1->pyramid.sigmaSq[keypoint1.octave];
-				const Point2D pt1 = proj1.CameraToImage(Xc1);
-				const Point2D diff1 = pt1 - keypoint1.pt;
-				if (!stereo1)
-				{
-					if (NormSq(diff1.x, diff1.y) > 5.991 * sigmaSq1)
-						continue;
-				}
-				else
-				{
-					const float d1 = proj1.DepthToDisparity(Xc1(2));
-					const float diff1z = (pt1.x - d1) - ur1;
-					if (NormSq(diff1.x, diff1.y, diff1z) > 7.8 * sigmaSq1)
-						continue;
-				}
+			mappoint->AddObservation(keyframe1, idx1);
+			mappoint->AddObservation(keyframe2, idx2);
 
-				// Check reprojection error in second keyframe
-				const float sigmaSq2 = keyframe2->pyramid.sigmaSq[keypoint2.octave];
-				const Point2D pt2 = proj2.CameraToImage(Xc2);
-				const Point2D diff2 = pt2 - keypoint2.pt;
-				if (!stereo2)
-				{
-					if (NormSq(diff2.x, diff2.y) > 5.991 * sigmaSq2)
-						continue;
-				}
-				else
-				{
-					const float d2 = proj2.DepthToDisparity(Xc2(2));
-					const float diff2z = (pt2.x - d2) - ur2;
-					if (NormSq(diff2.x, diff2.y, diff2z) > 7.8 * sigmaSq2)
-						continue;
-				}
+			keyframe1->AddMapPoint(mappoint, idx1);
+			keyframe2->AddMapPoint(mappoint, idx2);
 
-				//Check scale consistency
-				const Vec3D normal1 = Xw - Ow1;
-				const float dist1 = static_cast<float>(cv::norm(normal1));
+			mappoint->ComputeDistinctiveDescriptors();
+			mappoint->UpdateNormalAndDepth();
 
-				const Vec3D normal2 = Xw - Ow2;
-				const float dist2 = static_cast<float>(cv::norm(normal2));
+			map_->AddMapPoint(mappoint);
+			recentAddedMapPoints_.push_back(mappoint);
+		}
+	}
 
-				if (dist1 == 0 || dist2 == 0)
-					continue;
+	void CreateNewMapPoints(KeyFrame* currKeyFrame_)
+	{
+		KeyFrame* keyframe1 = currKeyFrame_;
 
-				const float ratioDist = dist2 / dist1;
-				const float scale1 = keyframe1->pyramid.scaleFactors[keypoint1.octave];
-				const float scale2 = keyframe2->pyramid.scaleFactors[keypoint2.octave];
-				const float ratioOctave = scale1 / scale2;
+		// Retrieve neighbor keyframes in covisibility graph
+		const int nneighbors = monocular_ ? 20 : 10;
+		const std::vector<KeyFrame*> neighborKFs = keyframe1->GetBestCovisibilityKeyFrames(nneighbors);
+		const int nKFs = static_cast<int>(neighborKFs.size());
 
-				if (ratioDist * ratioFactor < ratioOctave || ratioDist > ratioOctave * ratioFactor)
-					continue;
+		if (static_cast<int>(newPoints_.size()) < nKFs)
+			newPoints_.resize(nKFs);
 
-				// Triangulation is succesfull
-				MapPoint* mappoint = new MapPoint(Xw, keyframe1, map_);
+		// Search matches with epipolar restriction and triangulate
+		if (!pool_ || pool_->NumThreads() <= 1)
+		{
+			for (int i = 0; i < nKFs; i++)
+			{
+				if (i > 0 && CheckNewKeyFrames())
+					return;
 
-				mappoint->AddObservation(keyframe1, idx1);
-				mappoint->AddObservation(keyframe2, idx2);
+				newPoints_[i].clear();
+				TriangulateNewPoints(keyframe1, neighborKFs[i], newPoints_[i]);
+				AddNewMapPoints(keyframe1, neighborKFs[i], newPoints_[i]);
+			}
+			return;
+		}
 
-				keyframe1->AddMapPoint(mappoint, idx1);
-				keyframe2->AddMapPoint(mappoint, idx2);
+		// The neighbors are processed concurrently, then the MapPoints are created in the order of the neighbors.
+		// A keypoint matched in several neighbors keeps the point of the first one.
+		std::vector<uchar> aborted(nKFs, false);
+		ParallelFor(pool_, nKFs, [&](int i)
+		{
+			newPoints_[i].clear();
+			if (i > 0 && CheckNewKeyFrames())
+			{
+				aborted[i] = true;
+				return;
+			}
+			TriangulateNewPoints(keyframe1, neighborKFs[i], newPoints_[i]);
+		});
 
-				mappoint->ComputeDistinctiveDescriptors();
-				mappoint->UpdateNormalAndDepth();
+		// The creation is serialized on this thread. Each MapPoint constructor takes mutexPointCreation for its id,
+		// which is not recursive and so cannot be held around the whole batch.
+		for (int i = 0; i < nKFs; i++)
+		{
+			if (aborted[i])
+				return;
 
-				map_->AddMapPoint(mappoint);
-				recentAddedMapPoints_.push_back(mappoint);
-			}
+			AddNewMapPoints(keyframe1, neighborKFs[i], newPoints_[i]);
 		}
 	}
 
@@ -599,11 +779,23 @@ private:
 			}
 		}
 		
-		// Search matches by projection from current KF in target KFs
+		// Search matches by projection from current KF in target KFs.
+		// The searches only read the map and run concurrently, the fusions are then applied in order.
 		ORBmatcher matcher;
 		std::vector<MapPoint*> mappoints = currKeyFrame_->GetMapPointMatches();
-		for (KeyFrame* targetKF : targetKFs)
-			matcher.Fuse(targetKF, mappoints);
+
+		const int ntargets = static_cast<int>(targetKFs.size());
+		if (static_cast<int>(fuseMatches_.size()) < ntargets)
+			fuseMatches_.resize(ntargets);
+
+		ParallelFor(pool_, ntargets, [&](int i)
+		{
+			fuseMatches_[i].clear();
+			matcher.FuseSearch(targetKFs[i], mappoints, 0, mappoints.size(), fuseMatches_[i]);
+		});
+
+		for (int i = 0; i < ntargets; i++)
+			ORBmatcher::FuseApply(targetKFs[i], fuseMatches_[i]);
 
 		// Search matches by projection from target KFs in current KF
 		std::vector<MapPoint*> fuseCandidates;
@@ -621,7 +813,23 @@ private:
 			}
 		}
 
-		matcher.Fuse(currKeyFrame_, fuseCandidates);
+		// Same for the candidates, split in chunks
+		const int chunkSize = 256;
+		const int ncandidates = static_cast<int>(fuseCandidates.size());
+		const int nchunks = (ncandidates + chunkSize - 1) / chunkSize;
+		if (static_cast<int>(fuseMatches_.size()) < nchunks)
+			fuseMatches_.resize(nchunks);
+
+		ParallelFor(pool_, nchunks, [&](int c)
+		{
+			const size_t begin = c * chunkSize;
+			const size_t end = std::min(begin + chunkSize, fuseCandidates.size());
+			fuseMatches_[c].clear();
+			matcher.FuseSearch(currKeyFrame_, fuseCandidates, begin, end, fuseMatches_[c]);
+		});
+
+		for (int c = 0; c < nchunks; c++)
+			ORBmatcher::FuseApply(currKeyFrame_, fuseMatches_[c]);
 
 		// Update points
 		mappoints = currKeyFrame_->GetMapPointMatches();
@@ -702,16 +910,19 @@ private:
 
 	void ResetIfRequested()
 	{
-		LOCK_MUTEX_RESET();
-		if (resetRequested_)
 		{
+			LOCK_MUTEX_RESET();
+			if (!resetRequested_)
+				return;
+
 			newKeyFrames_.clear();
 			recentAddedMapPoints_.clear();
 			resetRequested_ = false;
 		}
+		Notify();
 	}
 
-	bool CheckFinish()
+	bool CheckFinish() const
 	{
 		LOCK_MUTEX_FINISH();
 		return finishRequested_;
@@ -719,10 +930,13 @@ private:
 
 	void SetFinish()
 	{
-		LOCK_MUTEX_FINISH();
-		finished_ = true;
-		LOCK_MUTEX_STOP();
-		stopped_ = true;
+		{
+			LOCK_MUTEX_FINISH();
+			finished_ = true;
+			LOCK_MUTEX_STOP();
+			stopped_ = true;
+		}
+		Notify();
 	}
 
 	bool monocular_;
@@ -746,16 +960,26 @@ private:
 
 	float thDepth_;
 
+	ThreadPool* pool_;
+
+	// Matches found by each concurrent search of SearchInNeighbors
+	std::vector<std::vector<ORBmatcher::FuseMatch>> fuseMatches_;
+
+	// Points triangulated with each neighbor by CreateNewMapPoints
+	std::vector<std::vector<NewPoint>> newPoints_;
+
 	mutable std::mutex mutexNewKFs_;
 	mutable std::mutex mutexReset_;
 	mutable std::mutex mutexFinish_;
 	mutable std::mutex mutexStop_;
 	mutable std::mutex mutexAccept_;
+	mutable std::mutex mutexWakeup_;
+	mutable std::condition_variable wakeup_;
 };
 
-LocalMapping::Pointer LocalMapping::Create(Map* map, bool monocular, float thDepth)
+LocalMapping::Pointer LocalMapping::Create(Map* map, bool monocular, float thDepth, ThreadPool* pool)
 {
-	return std::make_unique<LocalMappingImpl>(map, monocular, thDepth);
+	return std::make_unique<LocalMappingImpl>(map, monocular, thDepth, pool);
 }
 
 LocalMapping::~LocalMapping() {}
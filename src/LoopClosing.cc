@@ -22,6 +22,7 @@
 
 #include <mutex>
 #include <thread>
+#include <condition_variable>
 
 #include "Sim3Solver.h"
 #include "Optimizer.h"
@@ -32,7 +33,6 @@
 #include "ORBVocabulary.h"
 #include "Tracking.h"
 #include "LocalMapping.h"
-#include "Usleep.h"
 
 #define LOCK_MUTEX_LOOP_QUEUE() std::unique_lock<std::mutex> lock1(mutexLoopQueue_);
 #define LOCK_MUTEX_FINISH()     std::unique_lock<std::mutex> lock2(mutexFinish_);
@@ -380,11 +380,8 @@ public:
 				std::cout << "Updating map ..." << std::endl;
 				localMapper_->RequestStop();
 
-				// Wait until Local Mapping has effectively stopped
-				while (!localMapper_->isStopped() && !localMapper_->isFinished())
-				{
-					usleep(1000);
-				}
+				// Wait until Local Mapping has effectively stopped (a finished Local Mapping is stopped too)
+				localMapper_->WaitUntilStopped();
 
 				// Get Map Mutex
 				LOCK_MUTEX_MAP_UPDATE();
@@ -538,10 +535,7 @@ public:
 		}
 
 		// Wait until Local Mapping has effectively stopped
-		while (!localMapper_->isStopped())
-		{
-			usleep(1000);
-		}
+		localMapper_->WaitUntilStopped();
 
 		// Ensure current keyframe is updated
 		currentKF->UpdateConnections();
@@ -759,7 +753,8 @@ public:
 			if (CheckFinish())
 				break;
 
-			usleep(5000);
+			// Sleep until there is something to do
+			WaitFor([this]() { return CheckNewKeyFrames() || CheckReset() || CheckFinish(); });
 		}
 
 		SetFinish();
@@ -767,9 +762,14 @@ public:
 
 	void InsertKeyFrame(KeyFrame* keyframe) override
 	{
-		LOCK_MUTEX_LOOP_QUEUE();
-		if (keyframe->id != 0)
+		if (keyframe->id == 0)
+			return;
+
+		{
+			LOCK_MUTEX_LOOP_QUEUE();
 			keyFrameQueue_.push_back(keyframe);
+		}
+		Notify();
 	}
 
 	void RequestReset() override
@@ -778,16 +778,9 @@ public:
 			LOCK_MUTEX_RESET();
 			resetRequested_ = true;
 		}
+		Notify();
 
-		while (true)
-		{
-			{
-				LOCK_MUTEX_RESET();
-				if (!resetRequested_)
-					break;
-			}
-			usleep(5000);
-		}
+		WaitFor([this]() { return !CheckReset(); });
 	}
 
 	bool isRunningGBA() const override
@@ -802,8 +795,11 @@ public:
 
 	void RequestFinish() override
 	{
-		LOCK_MUTEX_FINISH();
-		finishRequested_ = true;
+		{
+			LOCK_MUTEX_FINISH();
+			finishRequested_ = true;
+		}
+		Notify();
 	}
 
 	bool isFinished() const override
@@ -820,13 +816,38 @@ public:
 
 	void ResetIfRequested()
 	{
-		LOCK_MUTEX_RESET();
-		if (resetRequested_)
 		{
+			LOCK_MUTEX_RESET();
+			if (!resetRequested_)
+				return;
+
 			keyFrameQueue_.clear();
 			lastLoopKFId_ = 0;
 			resetRequested_ = false;
 		}
+		Notify();
+	}
+
+	bool CheckReset() const
+	{
+		LOCK_MUTEX_RESET();
+		return resetRequested_;
+	}
+
+	// Same scheme as in the local mapping: the notifiers take mutexWakeup_ after changing the state
+	template <class Predicate>
+	void WaitFor(Predicate predicate) const
+	{
+		std::unique_lock<std::mutex> lock(mutexWakeup_);
+		wakeup_.wait(lock, predicate);
+	}
+
+	void Notify() const
+	{
+		{
+			std::unique_lock<std::mutex> lock(mutexWakeup_);
+		}
+		wakeup_.notify_all();
 	}
 
 	bool CheckFinish() const
@@ -866,6 +887,8 @@ private:
 	mutable std::mutex mutexReset_;
 	mutable std::mutex mutexFinish_;
 	mutable std::mutex mutexLoopQueue_;
+	mutable std::mutex mutexWakeup_;
+	mutable std::condition_variable wakeup_;
 };
 
 LoopClosing::Pointer LoopClosing::Create(Map* map, KeyFrameDatabase* keyframeDB, ORBVocabulary* voc, bool fixScale)
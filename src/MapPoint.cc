@@ -49,6 +49,7 @@ MapPoint::MapPoint(const Point3D& Xw, KeyFrame* referenceKF, Map* map) :
 {
 	Xw_ = Xw;
 	normal_ = Vec3D::zeros();
+	descriptor_ = Descriptor();
 	
 	// MapPoints can be created from Tracking and Local Mapping. This mutex avoid conflicts with id.
 	LOCK_MUTEX_POINT_CREATION();
@@ -74,7 +75,7 @@ MapPoint::MapPoint(const Point3D& Xw, Map* map, Frame* frame, int idx) :
 	maxDistance_ = scaleFactor * dist;
 	minDistance_ = maxDistance_ / frame->pyramid.scaleFactors.back();
 
-	frame->descriptors.row(idx).copyTo(descriptor_);
+	descriptor_ = frame->descriptors[idx];
 
 	// MapPoints can be created from Tracking and Local Mapping. This mutex avoid conflicts with id.
 	LOCK_MUTEX_POINT_CREATION();
@@ -268,42 +269,33 @@ void MapPoint::ComputeDistinctiveDescriptors()
 	if (observations.empty())
 		return;
 
-	std::vector<cv::Mat> descriptors;
+	Descriptors descriptors;
 	descriptors.reserve(observations.size());
-
 	for (const auto& observation : observations)
 	{
 		KeyFrame* keyframe = observation.first;
-		const int idx = static_cast<int>(observation.second);
+		const size_t idx = observation.second;
 		if (!keyframe->isBad())
-			descriptors.push_back(keyframe->descriptorsL.row(idx));
+			descriptors.push_back(keyframe->descriptorsL[idx]);
 	}
 
 	if (descriptors.empty())
 		return;
 
 	// Compute distances between them
-	const size_t N = descriptors.size();
-
-	std::vector<std::vector<int>> distances(N, std::vector<int>(N, 0));
-	for (size_t i = 0; i < N; i++)
-	{
-		distances[i][i] = 0;
-		for (size_t j = i + 1; j < N; j++)
-		{
-			const int distij = ORBmatcher::DescriptorDistance(descriptors[i], descriptors[j]);
-			distances[i][j] = distij;
-			distances[j][i] = distij;
-		}
-	}
+	const int N = static_cast<int>(descriptors.size());
+	const uint8_t* data = descriptors.data()->data;
+	std::vector<int> distances(N * N);
+	DescriptorDistances(data, sizeof(Descriptor), N, data, sizeof(Descriptor), N, distances.data());
 
 	// Take the descriptor with least median distance to the rest
 	int bestMedian = std::numeric_limits<int>::max();
-	size_t bestIdx = 0;
-	for (size_t i = 0; i < N; i++)
+	int bestIdx = 0;
+	std::vector<int> dists(N);
+	for (int i = 0; i < N; i++)
 	{
-		std::vector<int> dists(distances[i]);
-		std::sort(std::begin(dists), std::end(dists));
+		std::copy(std::begin(distances) + i * N, std::begin(distances) + (i + 1) * N, std::begin(dists));
+		std::nth_element(std::begin(dists), std::begin(dists) + (N - 1) / 2, std::end(dists));
 		const int median = dists[(N - 1) / 2];
 
 		if (median < bestMedian)
@@ -315,14 +307,14 @@ void MapPoint::ComputeDistinctiveDescriptors()
 
 	{
 		LOCK_MUTEX_FEATURES();
-		descriptor_ = descriptors[bestIdx].clone();
+		descriptor_ = descriptors[bestIdx];
 	}
 }
 
-cv::Mat MapPoint::GetDescriptor() const
+Descriptor MapPoint::GetDescriptor() const
 {
 	LOCK_MUTEX_FEATURES();
-	return descriptor_.clone();
+	return descriptor_;
 }
 
 int MapPoint::GetIndexInKeyFrame(const KeyFrame* keyframe) const
@@ -61,6 +61,15 @@
 
 #include <opencv2/opencv.hpp>
 
+#if defined(__AVX2__) || defined(__SSSE3__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "ThreadPool.h"
+#include "FAST.h"
+
 namespace ORB_SLAM2
 {
 
@@ -71,6 +80,20 @@ const int EDGE_THRESHOLD = 19;
 static inline int RoundUp(double v) { return static_cast<int>(std::ceil(v)); }
 static inline int RoundDn(double v) { return static_cast<int>(std::floor(v)); }
 
+// Runs func(i) for i in [0, n) on the thread pool, or serially if there is none
+template <class Func>
+static void ParallelFor(ThreadPool* pool, int n, const Func& func)
+{
+	if (pool)
+	{
+		pool->ParallelFor(n, func);
+		return;
+	}
+
+	for (int i = 0; i < n; i++)
+		func(i);
+}
+
 static float IC_Angle(const cv::Mat& image, cv::Point2f pt, const std::vector<int>& u_max)
 {
 	int m_01 = 0, m_10 = 0;
@@ -100,6 +123,112 @@ static float IC_Angle(const cv::Mat& image, cv::Point2f pt, const std::vector<in
 	return cv::fastAtan2((float)m_01, (float)m_10);
 }
 
+// Weights of the pixels of each row of the circular patch in the intensity centroid moments,
+// for the 32 pixels from u = -16 to u = 15 (u for m_10, v for m_01, 0 outside the patch)
+struct MomentWeights
+{
+	alignas(32) schar wx[PATCH_SIZE][32];
+	alignas(32) schar wy[PATCH_SIZE][32];
+};
+
+static void ComputeMomentWeights(const std::vector<int>& u_max, MomentWeights& weights)
+{
+	for (int v = -HALF_PATCH_SIZE; v <= HALF_PATCH_SIZE; v++)
+	{
+		const int d = u_max[std::abs(v)];
+		for (int i = 0; i < 32; i++)
+		{
+			const int u = i - 16;
+			const bool inside = u >= -d && u <= d;
+			weights.wx[v + HALF_PATCH_SIZE][i] = static_cast<schar>(inside ? u : 0);
+			weights.wy[v + HALF_PATCH_SIZE][i] = static_cast<schar>(inside ? v : 0);
+		}
+	}
+}
+
+#if defined(__SSSE3__)
+static inline int HorizontalSum(__m128i v)
+{
+	v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+	v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1)));
+	return _mm_cvtsi128_si32(v);
+}
+#endif
+
+// Computes the orientation of all the keypoints of a level, same as IC_Angle.
+// Each row of the patch is weighted with SIMD multiply-adds of 32 pixels.
+// The keypoints must be at least 16 pixels away from the left border.
+static void ComputeAngles(const cv::Mat& image, KeyPoints& keypoints, const std::vector<int>& u_max)
+{
+#if defined(__AVX2__) || defined(__SSSE3__) || defined(__ARM_NEON)
+	MomentWeights weights;
+	ComputeMomentWeights(u_max, weights);
+
+	const int step = static_cast<int>(image.step);
+
+	for (cv::KeyPoint& keypoint : keypoints)
+	{
+		CV_DbgAssert(cvRound(keypoint.pt.x) >= 16 && cvRound(keypoint.pt.x) + 15 < image.cols);
+
+		const uchar* ptr = &image.at<uchar>(cvRound(keypoint.pt.y), cvRound(keypoint.pt.x)) - HALF_PATCH_SIZE * step - 16;
+
+#if defined(__AVX2__)
+		const __m256i ones = _mm256_set1_epi16(1);
+		__m256i sum10 = _mm256_setzero_si256(), sum01 = _mm256_setzero_si256();
+		for (int r = 0; r < PATCH_SIZE; r++, ptr += step)
+		{
+			// Products fit in 16 bits: 2 * 255 * 16 < 2^15
+			const __m256i pixels = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(ptr));
+			const __m256i wx = _mm256_load_si256(reinterpret_cast<const __m256i*>(weights.wx[r]));
+			const __m256i wy = _mm256_load_si256(reinterpret_cast<const __m256i*>(weights.wy[r]));
+			sum10 = _mm256_add_epi32(sum10, _mm256_madd_epi16(_mm256_maddubs_epi16(pixels, wx), ones));
+			sum01 = _mm256_add_epi32(sum01, _mm256_madd_epi16(_mm256_maddubs_epi16(pixels, wy), ones));
+		}
+		const int m_10 = HorizontalSum(_mm_add_epi32(_mm256_castsi256_si128(sum10), _mm256_extracti128_si256(sum10, 1)));
+		const int m_01 = HorizontalSum(_mm_add_epi32(_mm256_castsi256_si128(sum01), _mm256_extracti128_si256(sum01, 1)));
+#elif defined(__SSSE3__)
+		const __m128i ones = _mm_set1_epi16(1);
+		__m128i sum10 = _mm_setzero_si128(), sum01 = _mm_setzero_si128();
+		for (int r = 0; r < PATCH_SIZE; r++, ptr += step)
+		{
+			for (int i = 0; i < 32; i += 16)
+			{
+				const __m128i pixels = _mm_loadu_si128(reinterpret_cast<const __m128i*>(ptr + i));
+				const __m128i wx = _mm_load_si128(reinterpret_cast<const __m128i*>(weights.wx[r] + i));
+				const __m128i wy = _mm_load_si128(reinterpret_cast<const __m128i*>(weights.wy[r] + i));
+				sum10 = _mm_add_epi32(sum10, _mm_madd_epi16(_mm_maddubs_epi16(pixels, wx), ones));
+				sum01 = _mm_add_epi32(sum01, _mm_madd_epi16(_mm_maddubs_epi16(pixels, wy), ones));
+			}
+		}
+		const int m_10 = HorizontalSum(sum10);
+		const int m_01 = HorizontalSum(sum01);
+#else
+		int32x4_t sum10 = vdupq_n_s32(0), sum01 = vdupq_n_s32(0);
+		for (int r = 0; r < PATCH_SIZE; r++, ptr += step)
+		{
+			for (int i = 0; i < 32; i += 8)
+			{
+				const int16x8_t pixels = vreinterpretq_s16_u16(vmovl_u8(vld1_u8(ptr + i)));
+				const int16x8_t wx = vmovl_s8(vld1_s8(weights.wx[r] + i));
+				const int16x8_t wy = vmovl_s8(vld1_s8(weights.wy[r] + i));
+				sum10 = vpadalq_s16(sum10, vmulq_s16(pixels, wx));
+				sum01 = vpadalq_s16(sum01, vmulq_s16(pixels, wy));
+			}
+		}
+		const int m_10 = vgetq_lane_s32(sum10, 0) + vgetq_lane_s32(sum10, 1) + vgetq_lane_s32(sum10, 2) + vgetq_lane_s32(sum10, 3);
+		const int m_01 = vgetq_lane_s32(sum01, 0) + vgetq_lane_s32(sum01, 1) + vgetq_lane_s32(sum01, 2) + vgetq_lane_s32(sum01, 3);
+#endif
+		keypoint.angle = cv::fastAtan2(static_cast<float>(m_01), static_cast<float>(m_10));
+
+		// The moments are the same integers as in the scalar version
+		CV_DbgAssert(keypoint.angle == IC_Angle(image, keypoint.pt, u_max));
+	}
+#else
+	for (cv::KeyPoint& keypoint : keypoints)
+		keypoint.angle = IC_Angle(image, keypoint.pt, u_max);
+#endif
+}
+
 static void ComputeOrbDescriptor(const cv::KeyPoint& kpt, const cv::Mat& img, const cv::Point* pattern, uchar* desc)
 {
 	const float factorPI = (float)(CV_PI / 180.f);
@@ -139,6 +268,79 @@ static void ComputeOrbDescriptor(const cv::KeyPoint& kpt, const cv::Mat& img, co
 #undef GET_VALUE
 }
 
+// Sampling pattern rotated to the angle of a keypoint, split into the first and second point of each test
+struct RotatedPattern
+{
+	schar x0[256], y0[256], x1[256], y1[256];
+};
+
+const int ANGLE_BINS = 30;
+
+// Rotates the pattern with the same expressions as ComputeOrbDescriptor, so that the descriptors are the same.
+// std::rint rounds to nearest even like cvRound, and lets the compiler vectorize the loop.
+static void RotatePattern(const cv::Point* pattern, float angle, RotatedPattern& rotated)
+{
+	const float factorPI = (float)(CV_PI / 180.f);
+	angle = angle*factorPI;
+	const float a = (float)cos(angle), b = (float)sin(angle);
+
+	for (int i = 0; i < 256; i++)
+	{
+		const cv::Point& p0 = pattern[2 * i + 0];
+		const cv::Point& p1 = pattern[2 * i + 1];
+		rotated.x0[i] = static_cast<schar>(std::rint(p0.x*a - p0.y*b));
+		rotated.y0[i] = static_cast<schar>(std::rint(p0.x*b + p0.y*a));
+		rotated.x1[i] = static_cast<schar>(std::rint(p1.x*a - p1.y*b));
+		rotated.y1[i] = static_cast<schar>(std::rint(p1.x*b + p1.y*a));
+	}
+}
+
+static inline int AngleBin(float angle)
+{
+	const int bin = cvRound(angle * ANGLE_BINS / 360.f);
+	return bin >= ANGLE_BINS ? bin - ANGLE_BINS : bin;
+}
+
+// Computes the descriptor from a rotated pattern, 8 tests at a time with AVX2 gathers
+static void ComputeOrbDescriptor(const uchar* center, int step, const RotatedPattern& pattern, uchar* desc)
+{
+	int i = 0;
+
+#if defined(__AVX2__)
+	const __m256i vstep = _mm256_set1_epi32(step);
+	const __m256i lsb = _mm256_set1_epi32(0xff);
+	const int* base = reinterpret_cast<const int*>(center);
+	for (; i < 256; i += 8)
+	{
+		const __m256i x0 = _mm256_cvtepi8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(pattern.x0 + i)));
+		const __m256i y0 = _mm256_cvtepi8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(pattern.y0 + i)));
+		const __m256i x1 = _mm256_cvtepi8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(pattern.x1 + i)));
+		const __m256i y1 = _mm256_cvtepi8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(pattern.y1 + i)));
+
+		const __m256i idx0 = _mm256_add_epi32(_mm256_mullo_epi32(y0, vstep), x0);
+		const __m256i idx1 = _mm256_add_epi32(_mm256_mullo_epi32(y1, vstep), x1);
+
+		// the gathers read 4 bytes per pixel, keep the first one
+		const __m256i t0 = _mm256_and_si256(_mm256_i32gather_epi32(base, idx0, 1), lsb);
+		const __m256i t1 = _mm256_and_si256(_mm256_i32gather_epi32(base, idx1, 1), lsb);
+
+		desc[i / 8] = static_cast<uchar>(_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(t1, t0))));
+	}
+#endif
+
+	for (; i < 256; i += 8)
+	{
+		int val = 0;
+		for (int k = 0; k < 8; k++)
+		{
+			const int t0 = center[pattern.y0[i + k] * step + pattern.x0[i + k]];
+			const int t1 = center[pattern.y1[i + k] * step + pattern.x1[i + k]];
+			val |= (t0 < t1) << k;
+		}
+		desc[i / 8] = static_cast<uchar>(val);
+	}
+}
+
 static int bit_pattern_31_[256 * 4] =
 {
 	8,-3, 9,5/*mean (0), correlation (0)*/,
@@ -399,73 +601,47 @@ static int bit_pattern_31_[256 * 4] =
 	-1,-6, 0,-11/*mean (0.127148), correlation (0.547401)*/
 };
 
-struct QTreeNode
+// Computes the image pyramid and the blurred pyramid used by the descriptors in a single pass.
+// Each level is blurred in strips of rows right after it is resized, while it is still in cache.
+// The strips are views of the whole level, so the blur reads the rows around them and the result
+// is the same as blurring the whole level. The output buffers are reused between frames.
+static void ComputePyramid(const cv::Mat& image, std::vector<cv::Mat>& images, std::vector<cv::Mat>& blurImages,
+	const std::vector<float>& invScaleFactors, ThreadPool* pool)
 {
-	QTreeNode() : divisible(true) {}
-
-	void divide(std::array<QTreeNode, 4>& nodes) const
-	{
-		const int hx = RoundUp(0.5 * (BR.x - TL.x));
-		const int hy = RoundUp(0.5 * (BR.y - TL.y));
-
-		const int x0 = TL.x;
-		const int x1 = TL.x + hx;
-		const int x2 = BR.x;
-
-		const int y0 = TL.y;
-		const int y1 = TL.y + hy;
-		const int y2 = BR.y;
-
-		// Define boundaries of childs
-		nodes[0].TL = cv::Point(x0, y0);
-		nodes[0].BR = cv::Point(x1, y1);
-
-		nodes[1].TL = cv::Point(x1, y0);
-		nodes[1].BR = cv::Point(x2, y1);
-
-		nodes[2].TL = cv::Point(x0, y1);
-		nodes[2].BR = cv::Point(x1, y2);
+	CV_Assert(image.type() == CV_8U);
 
-		nodes[3].TL = cv::Point(x1, y1);
-		nodes[3].BR = cv::Point(x2, y2);
+	const int STRIP_HEIGHT = 32;
 
-		for (int i = 0; i < 4; i++)
-			nodes[i].keypoints.reserve(keypoints.size());
+	const int nlevels = static_cast<int>(invScaleFactors.size());
+	images.resize(nlevels);
+	blurImages.resize(nlevels);
 
-		// Associate points to childs
-		for (const cv::KeyPoint& keypoint : keypoints)
+	for (int s = 0; s < nlevels; s++)
+	{
+		if (s == 0)
 		{
-			const float x = keypoint.pt.x;
-			const float y = keypoint.pt.y;
-			const int index = x < x1 ? (y < y1 ? 0 : 2) : (y < y1 ? 1 : 3);
-			nodes[index].keypoints.push_back(keypoint);
+			// The input is only read, so the first level refers to it without copy
+			images[0] = image;
+		}
+		else
+		{
+			const float invScale = invScaleFactors[s];
+			const int h = cvRound(invScale * image.rows);
+			const int w = cvRound(invScale * image.cols);
+			cv::resize(images[s - 1], images[s], cv::Size(w, h));
 		}
 
-		for (int i = 0; i < 4; i++)
-			if (nodes[i].keypoints.size() == 1)
-				nodes[i].divisible = false;
-	}
-
-	KeyPoints keypoints;
-	cv::Point TL, BR;
-	std::list<QTreeNode>::iterator it;
-	bool divisible;
-};
-
-static void ComputePyramid(const cv::Mat& image, std::vector<cv::Mat>& images, const std::vector<float>& invScaleFactors)
-{
-	CV_Assert(image.type() == CV_8U);
-
-	const int nlevels = static_cast<int>(invScaleFactors.size());
-	images.resize(nlevels);
+		const cv::Mat& src = images[s];
+		cv::Mat& dst = blurImages[s];
+		dst.create(src.size(), CV_8U);
 
-	image.copyTo(images[0]);
-	for (int s = 1; s < nlevels; s++)
-	{
-		const float invScale = invScaleFactors[s];
-		const int h = cvRound(invScale * image.rows);
-		const int w = cvRound(invScale * image.cols);
-		cv::resize(images[s - 1], images[s], cv::Size(w, h));
+		const int nstrips = (src.rows + STRIP_HEIGHT - 1) / STRIP_HEIGHT;
+		ParallelFor(pool, nstrips, [&](int i)
+		{
+			const cv::Range rows(i * STRIP_HEIGHT, std::min((i + 1) * STRIP_HEIGHT, src.rows));
+			cv::Mat strip = dst.rowRange(rows);
+			cv::GaussianBlur(src.rowRange(rows), strip, cv::Size(7, 7), 2, 2, cv::BORDER_REFLECT_101);
+		});
 	}
 }
 
@@ -486,7 +662,66 @@ static void ComputeNumFeaturesPerScale(int total, float scaleFactor, int nlevels
 	nfeaturesPerScale[nlevels - 1] = std::max(total - sumfeatures, 0);
 }
 
-static void DetectFAST(const cv::Mat& image, cv::Rect roi, KeyPoints& keypoints, int iniThFAST, int minThFAST)
+// Resizes the mask to each level of the pyramid, and computes the bounding box of its valid area
+// and the fraction of the detection area it leaves
+static void ComputeMaskPyramid(const cv::Mat& mask, const std::vector<cv::Mat>& images, int border,
+	std::vector<cv::Mat>& masks, std::vector<cv::Rect>& validRects, std::vector<double>& validRatios)
+{
+	const int nlevels = static_cast<int>(images.size());
+	masks.resize(nlevels);
+	validRects.resize(nlevels);
+	validRatios.resize(nlevels);
+
+	for (int s = 0; s < nlevels; s++)
+	{
+		cv::resize(mask, masks[s], images[s].size(), 0, 0, cv::INTER_NEAREST);
+		cv::compare(masks[s], 0, masks[s], cv::CMP_NE);
+
+		std::vector<cv::Point> points;
+		cv::findNonZero(masks[s], points);
+		validRects[s] = points.empty() ? cv::Rect() : cv::boundingRect(points);
+
+		const cv::Rect area(border, border, images[s].cols - 2 * border, images[s].rows - 2 * border);
+		validRatios[s] = area.area() > 0 ? 1. * cv::countNonZero(masks[s](area)) / area.area() : 0.;
+	}
+}
+
+// Weights the features of each level by the fraction of the level left by the mask,
+// keeping the total, so that the whole budget is spent on the valid area
+static void ComputeMaskedNumFeatures(const std::vector<int>& nfeaturesPerScale, const std::vector<double>& validRatios,
+	std::vector<int>& maskedNumFeatures)
+{
+	const int nlevels = static_cast<int>(nfeaturesPerScale.size());
+	maskedNumFeatures.assign(nlevels, 0);
+
+	int total = 0;
+	double sumWeights = 0;
+	int last = -1;
+	for (int s = 0; s < nlevels; s++)
+	{
+		total += nfeaturesPerScale[s];
+		sumWeights += nfeaturesPerScale[s] * validRatios[s];
+		if (validRatios[s] > 0)
+			last = s;
+	}
+
+	if (last < 0 || sumWeights <= 0)
+		return;
+
+	int sumfeatures = 0;
+	for (int s = 0; s < last; s++)
+	{
+		maskedNumFeatures[s] = cvRound(total * nfeaturesPerScale[s] * validRatios[s] / sumWeights);
+		sumfeatures += maskedNumFeatures[s];
+	}
+	maskedNumFeatures[last] = std::max(total - sumfeatures, 0);
+}
+
+// Detects the FAST corners of each cell of the grid with iniThFAST, or with minThFAST if the cell has none.
+// If lowCells is given, it remembers the cells that needed minThFAST, and these cells keep minThFAST
+// in the next frames until the corners at iniThFAST make up half of their corners again.
+static void DetectFAST(const cv::Mat& image, const cv::Mat& mask, cv::Rect roi, cv::Mat& scores, KeyPoints& keypoints,
+	int iniThFAST, int minThFAST, std::vector<uchar>* lowCells, ThreadPool* pool)
 {
 	const int CELL_SIZE = 30;
 
@@ -505,183 +740,334 @@ static void DetectFAST(const cv::Mat& image, cv::Rect roi, KeyPoints& keypoints,
 	const int maxx = roi.x + w;
 	const int maxy = roi.y + h;
 
-	const int gridw = w / CELL_SIZE;
-	const int gridh = h / CELL_SIZE;
+	const int gridw = std::max(w / CELL_SIZE, 1);
+	const int gridh = std::max(h / CELL_SIZE, 1);
 	const int cellw = RoundUp(1. * w / gridw);
 	const int cellh = RoundUp(1. * h / gridh);
 
 	const int FAST_RADIUS = 3;
 	const int DIAMETER = 2 * FAST_RADIUS;
 
-	KeyPoints _keypoints;
-	_keypoints.reserve(cellw * cellh);
+	int nrows = 0;
+	while (nrows < gridh && miny + nrows * cellh + DIAMETER < maxy)
+		nrows++;
 
-	for (int cy = 0, y0 = miny; cy < gridh && y0 + DIAMETER < maxy; cy++, y0 += cellh)
+	if (nrows == 0)
+		return;
+
+	// Score every pixel once at the lowest threshold, the cells then select their corners from the same scores
+	const cv::Rect scoreRect(minx + FAST_RADIUS, miny + FAST_RADIUS, w - DIAMETER, h - DIAMETER);
+
+	if (scores.size() != image.size() || scores.type() != CV_8U)
+		scores = cv::Mat::zeros(image.size(), CV_8U);
+
+	// The non-max suppression looks one pixel around the scored area
+	const cv::Rect frame = cv::Rect(scoreRect.x - 1, scoreRect.y - 1, scoreRect.width + 2, scoreRect.height + 2)
+		& cv::Rect(0, 0, image.cols, image.rows);
+	scores.row(frame.y).colRange(frame.x, frame.x + frame.width).setTo(0);
+	scores.row(frame.y + frame.height - 1).colRange(frame.x, frame.x + frame.width).setTo(0);
+	scores.col(frame.x).rowRange(frame.y, frame.y + frame.height).setTo(0);
+	scores.col(frame.x + frame.width - 1).rowRange(frame.y, frame.y + frame.height).setTo(0);
+
+	const int nbands = (scoreRect.height + cellh - 1) / cellh;
+	ParallelFor(pool, nbands, [&](int i)
 	{
+		const int y0 = scoreRect.y + i * cellh;
+		const int y1 = std::min(y0 + cellh, scoreRect.y + scoreRect.height);
+		ComputeFASTScores(image, cv::Rect(scoreRect.x, y0, scoreRect.width, y1 - y0), minThFAST, scores, mask);
+	});
+
+	if (lowCells && lowCells->size() != static_cast<size_t>(gridw * gridh))
+		lowCells->assign(gridw * gridh, 0);
+
+	// Rows of cells are processed independently and concatenated in order
+	std::vector<KeyPoints> rowKeypoints(nrows);
+
+	ParallelFor(pool, nrows, [&](int cy)
+	{
+		const int y0 = miny + cy * cellh;
+		const int y1 = std::min(y0 + cellh + DIAMETER, maxy);
+
+		KeyPoints& _keypoints = rowKeypoints[cy];
+
 		for (int cx = 0, x0 = minx; cx < gridw && x0 + DIAMETER < maxx; cx++, x0 += cellw)
 		{
-			const int y1 = std::min(y0 + cellh + DIAMETER, maxy);
 			const int x1 = std::min(x0 + cellw + DIAMETER, maxx);
 
-			cv::Mat _image = image(cv::Range(y0, y1), cv::Range(x0, x1));
-			cv::FAST(_image, _keypoints, iniThFAST, true);
+			const cv::Rect cell(x0 + FAST_RADIUS, y0 + FAST_RADIUS, x1 - x0 - DIAMETER, y1 - y0 - DIAMETER);
+			const size_t first = _keypoints.size();
+			FASTNonMaxSuppression(scores, cell, minThFAST, _keypoints);
 
-			if (_keypoints.empty())
-				cv::FAST(_image, _keypoints, minThFAST, true);
+			// The corners at iniThFAST are the corners at minThFAST with a higher score,
+			// so a single pass gives both
+			const auto isWeak = [=](const cv::KeyPoint& keypoint) { return keypoint.response < iniThFAST; };
+			const int ncorners = static_cast<int>(_keypoints.size() - first);
+			const int nweak = static_cast<int>(std::count_if(std::begin(_keypoints) + first, std::end(_keypoints), isWeak));
+			const int nstrong = ncorners - nweak;
 
-			for (cv::KeyPoint& keypoint : _keypoints)
-			{
-				keypoint.pt.x += x0;
-				keypoint.pt.y += y0;
-				keypoints.push_back(keypoint);
-			}
+			uchar* lowCell = lowCells ? &(*lowCells)[cy * gridw + cx] : nullptr;
+			const bool useMinTh = nstrong == 0 || (lowCell && *lowCell && 2 * nstrong < ncorners);
+
+			if (!useMinTh)
+				_keypoints.erase(std::remove_if(std::begin(_keypoints) + first, std::end(_keypoints), isWeak),
+					std::end(_keypoints));
+
+			if (lowCell)
+				*lowCell = useMinTh;
 		}
-	}
+	});
+
+	for (const KeyPoints& _keypoints : rowKeypoints)
+		keypoints.insert(std::end(keypoints), std::begin(_keypoints), std::end(_keypoints));
+}
+
+// Quadtree used to distribute the keypoints of a level.
+// Nodes are stored in a flat array and chained in a list of indices, which is visited in the same order
+// as the std::list of the original implementation, so the retained keypoints are the same.
+// Nodes refer to a range of keypoints, that is partitioned in place between the children.
+// The buffers keep their capacity between frames, so there are no allocations in steady state.
+class QuadTree
+{
+public:
+
+	void Suppress(const KeyPoints& src, cv::Rect roi, KeyPoints& dst, size_t nfeatures);
+
+private:
+
+	struct Node
+	{
+		int x0, y0, x1, y1;
+		int begin, end;
+		int prev, next;
+
+		int size() const { return end - begin; }
+	};
+
+	struct DivisibleNode { int size; int node; };
+
+	// Keypoint position, kept next to its index so that the partitions read contiguous memory
+	struct Item { cv::Point2f pt; int index; };
+
+	void PushFront(int node);
+	void PushBack(int node);
+	void Erase(int node);
+	void Divide(int node);
+
+	std::vector<Node> nodes_;
+	std::vector<Item> items_, buffer_;
+	std::vector<DivisibleNode> divisibles_, prevDivisibles_;
+	int head_, tail_, count_;
+};
+
+void QuadTree::PushFront(int node)
+{
+	nodes_[node].prev = -1;
+	nodes_[node].next = head_;
+	if (head_ >= 0)
+		nodes_[head_].prev = node;
+	else
+		tail_ = node;
+	head_ = node;
+	count_++;
+}
+
+void QuadTree::PushBack(int node)
+{
+	nodes_[node].prev = tail_;
+	nodes_[node].next = -1;
+	if (tail_ >= 0)
+		nodes_[tail_].next = node;
+	else
+		head_ = node;
+	tail_ = node;
+	count_++;
 }
 
-static void QuadTreeSuppression(const KeyPoints& src, cv::Rect roi, KeyPoints& dst, size_t nfeatures)
+void QuadTree::Erase(int node)
 {
+	const Node& n = nodes_[node];
+	if (n.prev >= 0)
+		nodes_[n.prev].next = n.next;
+	else
+		head_ = n.next;
+	if (n.next >= 0)
+		nodes_[n.next].prev = n.prev;
+	else
+		tail_ = n.prev;
+	count_--;
+}
+
+void QuadTree::Divide(int node)
+{
+	const Node parent = nodes_[node];
+
+	const int hx = RoundUp(0.5 * (parent.x1 - parent.x0));
+	const int hy = RoundUp(0.5 * (parent.y1 - parent.y0));
+
+	const int xs[3] = { parent.x0, parent.x0 + hx, parent.x1 };
+	const int ys[3] = { parent.y0, parent.y0 + hy, parent.y1 };
+
+	const auto quadrant = [&](const Item& item)
+	{
+		return item.pt.x < xs[1] ? (item.pt.y < ys[1] ? 0 : 2) : (item.pt.y < ys[1] ? 1 : 3);
+	};
+
+	// Associate points to childs, keeping their order
+	int counts[4] = { 0, 0, 0, 0 };
+	for (int i = parent.begin; i < parent.end; i++)
+		counts[quadrant(items_[i])]++;
+
+	int offsets[5] = { parent.begin };
+	for (int k = 0; k < 4; k++)
+		offsets[k + 1] = offsets[k] + counts[k];
+
+	int pos[4] = { offsets[0], offsets[1], offsets[2], offsets[3] };
+	for (int i = parent.begin; i < parent.end; i++)
+		buffer_[pos[quadrant(items_[i])]++] = items_[i];
+
+	std::copy(std::begin(buffer_) + parent.begin, std::begin(buffer_) + parent.end, std::begin(items_) + parent.begin);
+
+	// Add children if they contain points
+	for (int k = 0; k < 4; k++)
+	{
+		if (counts[k] == 0)
+			continue;
+
+		Node child;
+		child.x0 = xs[k & 1];
+		child.x1 = xs[(k & 1) + 1];
+		child.y0 = ys[k >> 1];
+		child.y1 = ys[(k >> 1) + 1];
+		child.begin = offsets[k];
+		child.end = offsets[k + 1];
+
+		const int index = static_cast<int>(nodes_.size());
+		nodes_.push_back(child);
+		PushFront(index);
+
+		if (child.size() > 1)
+			divisibles_.push_back({ child.size(), index });
+	}
+}
+void QuadTree::Suppress(const KeyPoints& src, cv::Rect roi, KeyPoints& dst, size_t nfeatures)
+{
+	CV_Assert(&src != &dst);
+
+	dst.clear();
+
 	if (src.empty() || roi.width <= 0 || roi.height <= 0)
 		return;
 
-	const int nnodes0 = cvRound(1. * roi.width / roi.height);
+	const int nnodes0 = std::max(cvRound(1. * roi.width / roi.height), 1);
 	const double hx = 1. * roi.width / nnodes0;
+	const int nkeypoints = static_cast<int>(src.size());
+
+	nodes_.clear();
+	divisibles_.clear();
+	items_.resize(nkeypoints);
+	buffer_.resize(nkeypoints);
+	head_ = tail_ = -1;
+	count_ = 0;
 
-	std::list<QTreeNode> nodes;
-	std::vector<QTreeNode*> pnodes(nnodes0);
 	for (int i = 0; i < nnodes0; i++)
 	{
-		QTreeNode node;
-		node.TL = cv::Point(static_cast<int>(roi.x + hx * (i + 0)), roi.y);
-		node.BR = cv::Point(static_cast<int>(roi.x + hx * (i + 1)), roi.y + roi.height);
-		node.keypoints.reserve(src.size());
-		nodes.push_back(node);
-		pnodes[i] = &nodes.back();
+		Node node;
+		node.x0 = static_cast<int>(roi.x + hx * (i + 0));
+		node.x1 = static_cast<int>(roi.x + hx * (i + 1));
+		node.y0 = roi.y;
+		node.y1 = roi.y + roi.height;
+		node.begin = node.end = 0;
+		nodes_.push_back(node);
 	}
 
-	for (const cv::KeyPoint& keypoint : src)
+	// Sort the keypoints by initial node, keeping their order
+	for (int i = 0; i < nkeypoints; i++)
 	{
-		const int nodeid = static_cast<int>((keypoint.pt.x - roi.x) / hx);
+		const int nodeid = static_cast<int>((src[i].pt.x - roi.x) / hx);
 		CV_Assert(nodeid < nnodes0);
-		pnodes[nodeid]->keypoints.push_back(keypoint);
+		buffer_[i].index = nodeid;
+		nodes_[nodeid].end++;
 	}
 
-	for (auto it = std::begin(nodes); it != std::end(nodes);)
+	for (int i = 0, begin = 0; i < nnodes0; i++)
 	{
-		if (it->keypoints.empty())
-		{
-			it = nodes.erase(it);
-		}
-		else
-		{
-			if (it->keypoints.size() == 1)
-				it->divisible = false;
-			++it;
-		}
+		const int size = nodes_[i].end;
+		nodes_[i].begin = nodes_[i].end = begin;
+		begin += size;
 	}
 
-	struct DivisibleNode { size_t size; const QTreeNode* ptr; };
-	std::vector<DivisibleNode> divisibles;
-	divisibles.reserve(4 * nodes.size());
+	for (int i = 0; i < nkeypoints; i++)
+		items_[nodes_[buffer_[i].index].end++] = { src[i].pt, i };
+
+	for (int i = 0; i < nnodes0; i++)
+		if (nodes_[i].size() > 0)
+			PushBack(i);
 
 	bool finish = false;
 	while (!finish)
 	{
-		size_t prevSize = nodes.size();
-		divisibles.clear();
+		int prevSize = count_;
+		divisibles_.clear();
 
-		for (auto it = std::begin(nodes); it != std::end(nodes);)
+		for (int node = head_; node >= 0;)
 		{
-			if (!it->divisible)
-			{
-				// If node only contains one point do not subdivide and continue
-				++it;
-				continue;
-			}
-
-			// If more than one point, subdivide
-			std::array<QTreeNode, 4> children;
-			it->divide(children);
+			// Children are added to the front, so the next node is the one following the current one
+			const int next = nodes_[node].next;
 
-			// Add children if they contain points
-			for (const QTreeNode& child : children)
+			// If node only contains one point do not subdivide and continue
+			if (nodes_[node].size() > 1)
 			{
-				if (child.keypoints.empty())
-					continue;
-
-				nodes.push_front(child);
-				if (child.keypoints.size() > 1)
-				{
-					QTreeNode& front = nodes.front();
-					front.it = std::begin(nodes);
-					divisibles.push_back({ child.keypoints.size(), &front });
-				}
+				// If more than one point, subdivide
+				Divide(node);
+				Erase(node);
 			}
 
-			it = nodes.erase(it);
+			node = next;
 		}
 
 		// Finish if there are more nodes than required features
 		// or all nodes contain just one point
-		if (nodes.size() >= nfeatures || nodes.size() == prevSize)
+		if (static_cast<size_t>(count_) >= nfeatures || count_ == prevSize)
 		{
 			finish = true;
 			break;
 		}
 
-		const int toExpand = static_cast<int>(divisibles.size());
-		if (nodes.size() + 3 * toExpand > nfeatures)
+		const int toExpand = static_cast<int>(divisibles_.size());
+		if (static_cast<size_t>(count_ + 3 * toExpand) > nfeatures)
 		{
 			while (!finish)
 			{
-				prevSize = nodes.size();
+				prevSize = count_;
 
-				std::vector<DivisibleNode> prevDivisibles = divisibles;
-				divisibles.clear();
+				prevDivisibles_.assign(std::begin(divisibles_), std::end(divisibles_));
+				divisibles_.clear();
 
-				std::sort(std::begin(prevDivisibles), std::end(prevDivisibles),
+				std::sort(std::begin(prevDivisibles_), std::end(prevDivisibles_),
 					[](const DivisibleNode& lhs, const DivisibleNode& rhs) { return lhs.size > rhs.size; });
 
-				for (const auto& node : prevDivisibles)
+				for (const DivisibleNode& node : prevDivisibles_)
 				{
-					std::array<QTreeNode, 4> children;
-					node.ptr->divide(children);
-
-					// Add children if they contain points
-					for (const QTreeNode& child : children)
-					{
-						if (child.keypoints.empty())
-							continue;
-
-						nodes.push_front(child);
-						if (child.keypoints.size() > 1)
-						{
-							QTreeNode& front = nodes.front();
-							front.it = std::begin(nodes);
-							divisibles.push_back({ child.keypoints.size(), &front });
-						}
-					}
-
-					nodes.erase(node.ptr->it);
-					if (nodes.size() >= nfeatures)
+					Divide(node.node);
+					Erase(node.node);
+					if (static_cast<size_t>(count_) >= nfeatures)
 						break;
 				}
 
-				if (nodes.size() >= nfeatures || nodes.size() == prevSize)
+				if (static_cast<size_t>(count_) >= nfeatures || count_ == prevSize)
 					finish = true;
 			}
 		}
 	}
 
 	// Retain the best point in each node
-	dst.clear();
-	dst.reserve(src.size());
-	for (const auto& node : nodes)
+	for (int node = head_; node >= 0; node = nodes_[node].next)
 	{
 		const cv::KeyPoint* bestKeypoint = nullptr;
 		float maxResponse = 0.f;
-		for (const cv::KeyPoint& keypoint : node.keypoints)
+		for (int i = nodes_[node].begin; i < nodes_[node].end; i++)
 		{
+			const cv::KeyPoint& keypoint = src[items_[i].index];
 			if (keypoint.response > maxResponse)
 			{
 				maxResponse = keypoint.response;
@@ -692,7 +1078,18 @@ static void QuadTreeSuppression(const KeyPoints& src, cv::Rect roi, KeyPoints& d
 	}
 }
 
-ORBextractor::ORBextractor(const Parameters& param) : param_(param) { Init(); }
+ORBextractor::ORBextractor(const Parameters& param, ThreadPool* pool) : param_(param), pool_(pool)
+{
+	if (!pool_ && param_.nthreads > 1)
+	{
+		threadPool_ = std::make_unique<ThreadPool>(param_.nthreads);
+		pool_ = threadPool_.get();
+	}
+
+	Init();
+}
+
+ORBextractor::~ORBextractor() {}
 
 void ORBextractor::Init()
 {
@@ -700,6 +1097,11 @@ void ORBextractor::Init()
 	const cv::Point* pattern0 = reinterpret_cast<const cv::Point*>(bit_pattern_31_);
 	std::copy(pattern0, pattern0 + npoints, std::back_inserter(pattern_));
 
+	// Precompute the pattern rotated to the center of each angle bin
+	rotatedPatterns_.create(ANGLE_BINS, sizeof(RotatedPattern), CV_8S);
+	for (int bin = 0; bin < ANGLE_BINS; bin++)
+		RotatePattern(pattern_.data(), 360.f * bin / ANGLE_BINS, *reinterpret_cast<RotatedPattern*>(rotatedPatterns_.ptr(bin)));
+
 	// This is for orientation
 	// pre-compute the end of a row in a circular patch
 	umax_.resize(HALF_PATCH_SIZE + 1);
@@ -738,42 +1140,83 @@ void ORBextractor::Init()
 
 	// Compute number of features in each scale
 	ComputeNumFeaturesPerScale(param_.nfeatures, scaleFactor, nlevels, nfeaturesPerScale_);
+
+	quadTrees_.resize(nlevels);
+	for (auto& quadTree : quadTrees_)
+		quadTree = std::make_unique<QuadTree>();
 }
 
 void ORBextractor::Extract(const cv::Mat& image, KeyPoints& keypoints, cv::Mat& descriptors)
 {
 	const int nfeatures = param_.nfeatures;
 	const int nlevels = param_.nlevels;
+	ThreadPool* pool = pool_;
 
 	keypoints_.resize(nlevels);
-	blurImages_.resize(nlevels);
+	candidates_.resize(nlevels);
+	scores_.resize(nlevels);
+	lowThresholdCells_.resize(nlevels);
 
 	// Compute pyramid image
-	ComputePyramid(image, images_, invScaleFactors_);
+	ComputePyramid(image, images_, blurImages_, invScaleFactors_, pool);
 
-	// Detect FAST corners
+	// Resize the mask to the pyramid
 	const int BORDER = EDGE_THRESHOLD - 3;
-	int nkeypoints = 0;
-	for (int s = 0; s < nlevels; s++)
+	const bool useMask = !mask_.empty();
+	if (useMask)
+	{
+		CV_Assert(mask_.size() == image.size());
+		if (maskPyramid_.empty())
+			ComputeMaskPyramid(mask_, images_, BORDER + 3, maskPyramid_, maskRects_, maskRatios_);
+		ComputeMaskedNumFeatures(nfeaturesPerScale_, maskRatios_, maskedNumFeatures_);
+	}
+
+	const std::vector<int>& nfeaturesPerScale = useMask ? maskedNumFeatures_ : nfeaturesPerScale_;
+
+	// Detect FAST corners
+	ParallelFor(pool, nlevels, [&](int s)
 	{
 		const cv::Mat& _image = images_[s];
-		const cv::Rect roi(BORDER, BORDER, _image.cols - 2 * BORDER, _image.rows - 2 * BORDER);
+		cv::Rect roi(BORDER, BORDER, _image.cols - 2 * BORDER, _image.rows - 2 * BORDER);
 
+		KeyPoints& candidates = candidates_[s];
 		KeyPoints& _keypoints = keypoints_[s];
-		_keypoints.reserve(10 * nfeatures);
+		candidates.clear();
+		_keypoints.clear();
+
+		if (useMask)
+		{
+			// Only detect around the valid area
+			const cv::Rect& rect = maskRects_[s];
+			roi &= cv::Rect(rect.x - 3, rect.y - 3, rect.width + 6, rect.height + 6);
+			if (rect.area() == 0 || roi.width <= 6 || roi.height <= 6)
+				return;
+		}
+
+		candidates.reserve(10 * nfeatures);
 
-		DetectFAST(_image, roi, _keypoints, param_.iniThFAST, param_.minThFAST);
-		QuadTreeSuppression(_keypoints, roi, _keypoints, nfeaturesPerScale_[s]);
+		DetectFAST(_image, useMask ? maskPyramid_[s] : cv::Mat(), roi, scores_[s], candidates,
+			param_.iniThFAST, param_.minThFAST, param_.thresholdMemory ? &lowThresholdCells_[s] : nullptr, pool);
+
+		quadTrees_[s]->Suppress(candidates, roi, _keypoints, nfeaturesPerScale[s]);
 
 		for (cv::KeyPoint& keypoint : _keypoints)
 		{
 			keypoint.octave = s;
 			keypoint.size = scaleFactors_[s] * PATCH_SIZE;
-			keypoint.angle = IC_Angle(_image, keypoint.pt, umax_);
 		}
 
-		nkeypoints += static_cast<int>(_keypoints.size());
-	}
+		ComputeAngles(_image, _keypoints, umax_);
+	});
+
+	// Offset of each level in the output
+	std::vector<int> offsets(nlevels + 1, 0);
+	for (int s = 0; s < nlevels; s++)
+		offsets[s + 1] = offsets[s] + static_cast<int>(keypoints_[s].size());
+
+	const int nkeypoints = offsets[nlevels];
+
+	keypoints.clear();
 
 	if (nkeypoints == 0)
 	{
@@ -785,40 +1228,82 @@ void ORBextractor::Extract(const cv::Mat& image, KeyPoints& keypoints, cv::Mat&
 	descriptors.create(nkeypoints, 32, CV_8U);
 	descriptors.setTo(0);
 
-	keypoints.clear();
-	keypoints.reserve(nkeypoints);
-
-	int offset = 0;
-	for (int s = 0; s < nlevels; s++)
+	// Compute the descriptors in chunks of keypoints, so that the work is evenly split between threads
+	const int CHUNK_SIZE = 128;
+	const int nchunks = (nkeypoints + CHUNK_SIZE - 1) / CHUNK_SIZE;
+	ParallelFor(pool, nchunks, [&](int c)
 	{
-		KeyPoints& _keypoints = keypoints_[s];
-		if (_keypoints.empty())
-			continue;
+		const int i0 = c * CHUNK_SIZE;
+		const int i1 = std::min(i0 + CHUNK_SIZE, nkeypoints);
 
-		// preprocess the resized image
-		cv::GaussianBlur(images_[s], blurImages_[s], cv::Size(7, 7), 2, 2, cv::BORDER_REFLECT_101);
-
-		// Compute the descriptors
-		const int npoints = static_cast<int>(_keypoints.size());
-		for (int i = 0; i < npoints; i++)
+		int s = static_cast<int>(std::upper_bound(std::begin(offsets), std::end(offsets), i0) - std::begin(offsets)) - 1;
+		for (int i = i0; i < i1; i++)
 		{
-			uchar* desc = descriptors.ptr(i + offset);
-			ComputeOrbDescriptor(_keypoints[i], blurImages_[s], pattern_.data(), desc);
-		}
-		offset += npoints;
+			while (i >= offsets[s + 1])
+				s++;
 
-		// Scale keypoint coordinates
-		if (s > 0)
-		{
-			for (cv::KeyPoint& keypoint : _keypoints)
+			cv::KeyPoint& keypoint = keypoints_[s][i - offsets[s]];
+			const cv::Mat& _image = blurImages_[s];
+
+			if (param_.descriptorMode == DESCRIPTOR_REFERENCE)
+			{
+				ComputeOrbDescriptor(keypoint, _image, pattern_.data(), descriptors.ptr(i));
+			}
+			else
+			{
+				RotatedPattern rotated;
+				const RotatedPattern* pattern = &rotated;
+				if (param_.descriptorMode == DESCRIPTOR_QUANTIZED)
+					pattern = reinterpret_cast<const RotatedPattern*>(rotatedPatterns_.ptr(AngleBin(keypoint.angle)));
+				else
+					RotatePattern(pattern_.data(), keypoint.angle, rotated);
+
+				const uchar* center = &_image.at<uchar>(cvRound(keypoint.pt.y), cvRound(keypoint.pt.x));
+				ComputeOrbDescriptor(center, static_cast<int>(_image.step), *pattern, descriptors.ptr(i));
+			}
+
+			// Scale keypoint coordinates
+			if (s > 0)
 				keypoint.pt *= scaleFactors_[s];
 		}
+	});
 
-		// And add the keypoints to the output
-		keypoints.insert(std::end(keypoints), std::begin(_keypoints), std::end(_keypoints));
-	}
+	// And add the keypoints to the output
+	keypoints.reserve(nkeypoints);
+	for (int s = 0; s < nlevels; s++)
+		keypoints.insert(std::end(keypoints), std::begin(keypoints_[s]), std::end(keypoints_[s]));
+}
+
+void ORBextractor::SetNumFeatures(int nfeatures)
+{
+	if (nfeatures == param_.nfeatures)
+		return;
+
+	param_.nfeatures = nfeatures;
+	ComputeNumFeaturesPerScale(param_.nfeatures, param_.scaleFactor, param_.nlevels, nfeaturesPerScale_);
+}
+
+void ORBextractor::SetFASTThresholds(int iniThFAST, int minThFAST)
+{
+	param_.iniThFAST = iniThFAST;
+	param_.minThFAST = minThFAST;
+}
+
+void ORBextractor::ResetThresholdMemory()
+{
+	for (std::vector<uchar>& lowCells : lowThresholdCells_)
+		std::fill(std::begin(lowCells), std::end(lowCells), 0);
+}
+
+void ORBextractor::SetMask(const cv::Mat& mask)
+{
+	CV_Assert(mask.empty() || mask.type() == CV_8U);
+	mask_ = mask.clone();
+	maskPyramid_.clear();
+	lowThresholdCells_.clear();
 }
 
+int ORBextractor::GetNumFeatures() const { return param_.nfeatures; }
 int ORBextractor::GetLevels() const { return param_.nlevels; }
 float ORBextractor::GetScaleFactor() const { return param_.scaleFactor; }
 const std::vector<float>& ORBextractor::GetScaleFactors() const { return scaleFactors_; }
@@ -826,9 +1311,12 @@ const std::vector<float>& ORBextractor::GetInverseScaleFactors() const { return
 const std::vector<float>& ORBextractor::GetScaleSigmaSquares() const { return sigmaSq_; }
 const std::vector<float>& ORBextractor::GetInverseScaleSigmaSquares() const { return invSigmaSq_; }
 const std::vector<cv::Mat>& ORBextractor::GetImagePyramid() const { return images_; }
+const std::vector<cv::Mat>& ORBextractor::GetBlurredPyramid() const { return blurImages_; }
 
-ORBextractor::Parameters::Parameters(int nfeatures, float scaleFactor, int nlevels, int iniThFAST, int minThFAST)
-	: nfeatures(nfeatures), scaleFactor(scaleFactor), nlevels(nlevels), iniThFAST(iniThFAST), minThFAST(minThFAST)
+ORBextractor::Parameters::Parameters(int nfeatures, float scaleFactor, int nlevels, int iniThFAST, int minThFAST,
+	int nthreads, int descriptorMode, bool thresholdMemory) : nfeatures(nfeatures), scaleFactor(scaleFactor), nlevels(nlevels),
+	iniThFAST(iniThFAST), minThFAST(minThFAST), nthreads(nthreads), descriptorMode(descriptorMode),
+	thresholdMemory(thresholdMemory)
 {
 }
 
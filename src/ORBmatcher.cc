@@ -21,15 +21,15 @@
 #include "ORBmatcher.h"
 #include "CameraPose.h"
 #include "CameraProjection.h"
+#include "ThreadPool.h"
+#include "DescriptorDistance.h"
 
 #include <Thirdparty/DBoW2/DBoW2/FeatureVector.h>
 
-#ifdef _WIN32
-#define popcnt32 __popcnt
-#define popcnt64 __popcnt64
-#else
-#define popcnt32 __builtin_popcount
-#define popcnt64 __builtin_popcountll
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
 #endif
 
 namespace ORB_SLAM2
@@ -57,45 +57,148 @@ template <typename T> static inline T InvalidMatch() { return 0; }
 template <> inline MapPoint* InvalidMatch<MapPoint*>() { return nullptr; }
 template <> inline int InvalidMatch<int>() { return -1; }
 
-static int PatchDistance(const cv::Mat1b& patchL, const cv::Mat1b& patchR)
+// SAD of two patches given by their centers, after subtracting the difference of the centers
+static int PatchDistance(const uchar* centerL, const uchar* centerR, int stepL, int stepR)
 {
-	const int sub = patchL(PATCH_RADIUS, PATCH_RADIUS) - patchR(PATCH_RADIUS, PATCH_RADIUS);
+	const int sub = centerL[0] - centerR[0];
 	int sum = 0;
-	for (int y = 0; y < PATCH_SIZE; y++)
-		for (int x = 0; x < PATCH_SIZE; x++)
-			sum += std::abs(patchL(y, x) - patchR(y, x) - sub);
+	for (int y = -PATCH_RADIUS; y <= PATCH_RADIUS; y++)
+		for (int x = -PATCH_RADIUS; x <= PATCH_RADIUS; x++)
+			sum += std::abs(centerL[y * stepL + x] - centerR[y * stepR + x] - sub);
 	return sum;
 }
 
-// Search a match for each keypoint in the left image to a keypoint in the right image.
-// If there is a match, depth is computed and the right coordinate associated to the left keypoint is stored.
-void ComputeStereoMatches(
+// Computes PatchDistance between the left patch and the right patches shifted by dx in [-SEARCH_RADIUS, SEARCH_RADIUS]
+// in one sweep, from the raw rows. The SIMD versions read 16 pixels per patch row, 5 past the patch.
+// SCALAR_PATCH_DISTANCE selects the scalar version, for the comparison in stereo_benchmark_scalar.
+static void ComputePatchDistances(const uchar* centerL, const uchar* centerR, int stepL, int stepR, int* distances)
+{
+#if defined(__SSE2__) && !defined(SCALAR_PATCH_DISTANCE)
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i ones = _mm_set1_epi16(1);
+
+	// Only 3 of the 8 upper pixels are in the patch
+	const __m128i maskHi = _mm_setr_epi16(-1, -1, -1, 0, 0, 0, 0, 0);
+
+	// Rows of the left patch widened to 16 bits once for all the shifts
+	__m128i rowsL[PATCH_SIZE][2];
+	for (int y = 0; y < PATCH_SIZE; y++)
+	{
+		const uchar* ptrL = centerL + (y - PATCH_RADIUS) * stepL - PATCH_RADIUS;
+		const __m128i L = _mm_loadu_si128(reinterpret_cast<const __m128i*>(ptrL));
+		rowsL[y][0] = _mm_unpacklo_epi8(L, zero);
+		rowsL[y][1] = _mm_unpackhi_epi8(L, zero);
+	}
+
+	for (int dx = -SEARCH_RADIUS; dx <= SEARCH_RADIUS; dx++)
+	{
+		const __m128i sub = _mm_set1_epi16(static_cast<short>(centerL[0] - centerR[dx]));
+
+		// Absolute differences are at most 510, their sums fit in 16 bits
+		__m128i sum0 = zero, sum1 = zero;
+		for (int y = 0; y < PATCH_SIZE; y++)
+		{
+			const uchar* ptrR = centerR + (y - PATCH_RADIUS) * stepR + dx - PATCH_RADIUS;
+			const __m128i R = _mm_loadu_si128(reinterpret_cast<const __m128i*>(ptrR));
+			const __m128i d0 = _mm_sub_epi16(_mm_sub_epi16(rowsL[y][0], _mm_unpacklo_epi8(R, zero)), sub);
+			const __m128i d1 = _mm_sub_epi16(_mm_sub_epi16(rowsL[y][1], _mm_unpackhi_epi8(R, zero)), sub);
+			sum0 = _mm_add_epi16(sum0, _mm_max_epi16(d0, _mm_sub_epi16(zero, d0)));
+			sum1 = _mm_add_epi16(sum1, _mm_max_epi16(d1, _mm_sub_epi16(zero, d1)));
+		}
+
+		__m128i sum = _mm_madd_epi16(_mm_add_epi16(sum0, _mm_and_si128(sum1, maskHi)), ones);
+		sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+		sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2, 3, 0, 1)));
+		distances[SEARCH_RADIUS + dx] = _mm_cvtsi128_si32(sum);
+	}
+#elif defined(__ARM_NEON) && !defined(SCALAR_PATCH_DISTANCE)
+	static const int16_t MASK_HI[8] = { -1, -1, -1, 0, 0, 0, 0, 0 };
+	const int16x8_t maskHi = vld1q_s16(MASK_HI);
+
+	int16x8_t rowsL[PATCH_SIZE][2];
+	for (int y = 0; y < PATCH_SIZE; y++)
+	{
+		const uint8x16_t L = vld1q_u8(centerL + (y - PATCH_RADIUS) * stepL - PATCH_RADIUS);
+		rowsL[y][0] = vreinterpretq_s16_u16(vmovl_u8(vget_low_u8(L)));
+		rowsL[y][1] = vreinterpretq_s16_u16(vmovl_u8(vget_high_u8(L)));
+	}
+
+	for (int dx = -SEARCH_RADIUS; dx <= SEARCH_RADIUS; dx++)
+	{
+		const int16x8_t sub = vdupq_n_s16(static_cast<int16_t>(centerL[0] - centerR[dx]));
+
+		int16x8_t sum0 = vdupq_n_s16(0), sum1 = vdupq_n_s16(0);
+		for (int y = 0; y < PATCH_SIZE; y++)
+		{
+			const uint8x16_t R = vld1q_u8(centerR + (y - PATCH_RADIUS) * stepR + dx - PATCH_RADIUS);
+			const int16x8_t R0 = vreinterpretq_s16_u16(vmovl_u8(vget_low_u8(R)));
+			const int16x8_t R1 = vreinterpretq_s16_u16(vmovl_u8(vget_high_u8(R)));
+			sum0 = vabaq_s16(sum0, vsubq_s16(rowsL[y][0], R0), sub);
+			sum1 = vabaq_s16(sum1, vsubq_s16(rowsL[y][1], R1), sub);
+		}
+
+		const int32x4_t sum = vpaddlq_s16(vaddq_s16(sum0, vandq_s16(sum1, maskHi)));
+		distances[SEARCH_RADIUS + dx] = vgetq_lane_s32(sum, 0) + vgetq_lane_s32(sum, 1) +
+			vgetq_lane_s32(sum, 2) + vgetq_lane_s32(sum, 3);
+	}
+#else
+	for (int dx = -SEARCH_RADIUS; dx <= SEARCH_RADIUS; dx++)
+		distances[SEARCH_RADIUS + dx] = PatchDistance(centerL, centerR + dx, stepL, stepR);
+#endif
+}
+
+void StereoMatcher::Compute(
 	const KeyPoints& keypointsL, const cv::Mat& descriptorsL, const Pyramid& pyramidL,
 	const KeyPoints& keypointsR, const cv::Mat& descriptorsR, const Pyramid& pyramidR,
 	const std::vector<float>& scaleFactors, const std::vector<float>& invScaleFactors, const CameraParams& camera,
-	std::vector<float>& uright, std::vector<float>& depth)
+	std::vector<float>& uright, std::vector<float>& depth, ThreadPool* pool)
 {
 	const int nkeypointsL = static_cast<int>(keypointsL.size());
 	uright.assign(nkeypointsL, -1.f);
 	depth.assign(nkeypointsL, -1.f);
 
-	//Assign keypoints to row table
+	// Assign keypoints to row table
+	// Each right keypoint covers the rows within 2 scale units of its y
 	const int nrows = pyramidL[0].rows;
-	std::vector<std::vector<int>> rowIndices(nrows);
+	const int nkeypointsR = static_cast<int>(keypointsR.size());
+	const auto rowRange = [&](const cv::KeyPoint& keypoint)
+	{
+		const float r = 2.f * scaleFactors[keypoint.octave];
+		return cv::Range(std::max(RoundDn(keypoint.pt.y - r), 0), std::min(RoundUp(keypoint.pt.y + r), nrows - 1) + 1);
+	};
 
-	for (int i = 0; i < nrows; i++)
-		rowIndices[i].reserve(200);
+	// First pass: count the keypoints of each row
+	rowOffsets_.assign(nrows + 1, 0);
+	for (const cv::KeyPoint& keypoint : keypointsR)
+	{
+		const cv::Range rows = rowRange(keypoint);
+		for (int y = rows.start; y < rows.end; y++)
+			rowOffsets_[y + 1]++;
+	}
 
-	const int nkeypointsR = static_cast<int>(keypointsR.size());
+	for (int y = 0; y < nrows; y++)
+		rowOffsets_[y + 1] += rowOffsets_[y];
+
+	// Second pass: fill the rows, in increasing u so that each row is sorted
+	sortedIndices_.resize(nkeypointsR);
 	for (int iR = 0; iR < nkeypointsR; iR++)
+		sortedIndices_[iR] = iR;
+
+	std::sort(std::begin(sortedIndices_), std::end(sortedIndices_), [&](int i1, int i2)
+	{
+		const float u1 = keypointsR[i1].pt.x;
+		const float u2 = keypointsR[i2].pt.x;
+		return u1 < u2 || (u1 == u2 && i1 < i2);
+	});
+
+	candidates_.resize(rowOffsets_[nrows]);
+	rowEnds_.assign(std::begin(rowOffsets_), std::end(rowOffsets_) - 1);
+	for (int iR : sortedIndices_)
 	{
 		const cv::KeyPoint& keypoint = keypointsR[iR];
-		const float y0 = keypoint.pt.y;
-		const float r = 2.f * scaleFactors[keypoint.octave];
-		const int miny = RoundDn(y0 - r);
-		const int maxy = RoundUp(y0 + r);
-		for (int y = miny; y <= maxy; y++)
-			rowIndices[y].push_back(iR);
+		const cv::Range rows = rowRange(keypoint);
+		for (int y = rows.start; y < rows.end; y++)
+			candidates_[rowEnds_[y]++] = { keypoint.pt.x, keypoint.octave, iR };
 	}
 
 	// Set limits for search
@@ -104,129 +207,149 @@ void ComputeStereoMatches(
 	const float maxd = camera.bf / minZ;
 
 	// For each left keypoint search a match in the right image
-	std::vector<std::pair<int, int>> distIndices;
-	distIndices.reserve(nkeypointsL);
-
-	std::vector<int> distances(2 * SEARCH_RADIUS + 1);
+	// Chunks of left keypoints are matched concurrently, each one with its own list of distances
+	const int CHUNK_SIZE = 128;
+	const int nchunks = (nkeypointsL + CHUNK_SIZE - 1) / CHUNK_SIZE;
+	chunkDistIndices_.resize(nchunks);
 
 	const int TH_ORB_DIST = (TH_HIGH + TH_LOW) / 2;
 	const float eps = 0.01f;
 
-	for (int iL = 0; iL < nkeypointsL; iL++)
+	const auto matchChunk = [&](int chunk)
 	{
-		const cv::KeyPoint& keypointL = keypointsL[iL];
-		const int octaveL = keypointL.octave;
-		const float vL = keypointL.pt.y;
-		const float uL = keypointL.pt.x;
+		std::vector<std::pair<int, int>>& distIndices = chunkDistIndices_[chunk];
+		distIndices.clear();
 
-		const std::vector<int>& candidates = rowIndices[static_cast<int>(vL)];
+		int distances[2 * SEARCH_RADIUS + 1];
 
-		if (candidates.empty())
-			continue;
+		const int chunkBegin = chunk * CHUNK_SIZE;
+		const int chunkEnd = std::min(chunkBegin + CHUNK_SIZE, nkeypointsL);
+		for (int iL = chunkBegin; iL < chunkEnd; iL++)
+		{
+			const cv::KeyPoint& keypointL = keypointsL[iL];
+			const int octaveL = keypointL.octave;
+			const float vL = keypointL.pt.y;
+			const float uL = keypointL.pt.x;
 
-		const float minu = uL - maxd;
-		const float maxu = uL - mind;
+			const int row = static_cast<int>(vL);
+			const Candidate* rowBegin = candidates_.data() + rowOffsets_[row];
+			const Candidate* rowEnd = candidates_.data() + rowOffsets_[row + 1];
 
-		if (maxu < 0)
-			continue;
+			if (rowBegin == rowEnd)
+				continue;
 
-		int minDist = TH_HIGH;
-		int bestIdxR = 0;
+			const float minu = uL - maxd;
+			const float maxu = uL - mind;
 
-		const cv::Mat& descL = descriptorsL.row(iL);
+			if (maxu < 0)
+				continue;
 
-		// Compare descriptor to right keypoints
-		for (int iR : candidates)
-		{
-			const cv::KeyPoint& keypointR = keypointsR[iR];
-			const int octaveR = keypointR.octave;
+			int minDist = TH_HIGH;
+			int bestIdxR = 0;
 
-			if (octaveR < octaveL - 1 || octaveR > octaveL + 1)
-				continue;
+			const uint8_t* descL = descriptorsL.ptr<uint8_t>(iL);
 
-			const float uR = keypointR.pt.x;
+			// Compare descriptor to the right keypoints in the disparity range
+			// On equal distance the first right keypoint wins, as when scanning them by index
+			const Candidate* first = std::lower_bound(rowBegin, rowEnd, minu,
+				[](const Candidate& candidate, float u) { return candidate.u < u; });
 
-			if (uR >= minu && uR <= maxu)
+			for (const Candidate* candidate = first; candidate != rowEnd && candidate->u <= maxu; ++candidate)
 			{
-				const cv::Mat& descR = descriptorsR.row(iR);
-				const int dist = ORBmatcher::DescriptorDistance(descL, descR);
+				const int octaveR = candidate->octave;
+
+				if (octaveR < octaveL - 1 || octaveR > octaveL + 1)
+					continue;
 
-				if (dist < minDist)
+				const int iR = candidate->idx;
+				const int dist = ORB_SLAM2::DescriptorDistance(descL, descriptorsR.ptr<uint8_t>(iR));
+
+				if (dist < minDist || (dist == minDist && iR < bestIdxR))
 				{
 					minDist = dist;
 					bestIdxR = iR;
 				}
 			}
-		}
-
-		// Subpixel match by correlation
-		if (minDist < TH_ORB_DIST)
-		{
-			const cv::Mat& imageL = pyramidL[octaveL];
-			const cv::Mat& imageR = pyramidR[octaveL];
 
-			// coordinates in image pyramid at keypoint scale
-			const float scaleFactor = invScaleFactors[octaveL];
-			const int suL = Round(scaleFactor * keypointL.pt.x);
-			const int svL = Round(scaleFactor * keypointL.pt.y);
-			const int suR = Round(scaleFactor * keypointsR[bestIdxR].pt.x);
+			// Subpixel match by correlation
+			if (minDist < TH_ORB_DIST)
+			{
+				const cv::Mat& imageL = pyramidL[octaveL];
+				const cv::Mat& imageR = pyramidR[octaveL];
 
-			// sliding window search
-			const cv::Rect roiL(suL - PATCH_RADIUS, svL - PATCH_RADIUS, PATCH_SIZE, PATCH_SIZE);
-			cv::Mat IL = imageL(roiL);
+				// coordinates in image pyramid at keypoint scale
+				const float scaleFactor = invScaleFactors[octaveL];
+				const int suL = Round(scaleFactor * keypointL.pt.x);
+				const int svL = Round(scaleFactor * keypointL.pt.y);
+				const int suR = Round(scaleFactor * keypointsR[bestIdxR].pt.x);
 
-			int minDist = std::numeric_limits<int>::max();
-			int bestdxR = 0;
+				// sliding window search
+				if (suR - SEARCH_RADIUS - PATCH_RADIUS < 0 || suR + SEARCH_RADIUS + PATCH_RADIUS + 1 >= imageR.cols)
+					continue;
 
-			if (suR + SEARCH_RADIUS - PATCH_RADIUS < 0 || suR + SEARCH_RADIUS + PATCH_RADIUS + 1 >= imageR.cols)
-				continue;
+				ComputePatchDistances(imageL.ptr<uchar>(svL, suL), imageR.ptr<uchar>(svL, suR),
+					static_cast<int>(imageL.step), static_cast<int>(imageR.step), distances);
 
-			for (int dxR = -SEARCH_RADIUS; dxR <= SEARCH_RADIUS; dxR++)
-			{
-				const cv::Rect roiR(suR + dxR - PATCH_RADIUS, svL - PATCH_RADIUS, PATCH_SIZE, PATCH_SIZE);
-				cv::Mat IR = imageR(roiR);
+				int minDist = std::numeric_limits<int>::max();
+				int bestdxR = 0;
 
-				const int dist = PatchDistance(IL, IR);
-				if (dist < minDist)
+				for (int dxR = -SEARCH_RADIUS; dxR <= SEARCH_RADIUS; dxR++)
 				{
-					minDist = dist;
-					bestdxR = dxR;
+					const int dist = distances[SEARCH_RADIUS + dxR];
+					if (dist < minDist)
+					{
+						minDist = dist;
+						bestdxR = dxR;
+					}
 				}
 
-				distances[SEARCH_RADIUS + dxR] = dist;
-			}
-
-			if (bestdxR == -SEARCH_RADIUS || bestdxR == SEARCH_RADIUS)
-				continue;
+				if (bestdxR == -SEARCH_RADIUS || bestdxR == SEARCH_RADIUS)
+					continue;
 
-			// Sub-pixel match (Parabola fitting)
-			const int dist1 = distances[SEARCH_RADIUS + bestdxR - 1];
-			const int dist2 = distances[SEARCH_RADIUS + bestdxR];
-			const int dist3 = distances[SEARCH_RADIUS + bestdxR + 1];
+				// Sub-pixel match (Parabola fitting)
+				const int dist1 = distances[SEARCH_RADIUS + bestdxR - 1];
+				const int dist2 = distances[SEARCH_RADIUS + bestdxR];
+				const int dist3 = distances[SEARCH_RADIUS + bestdxR + 1];
 
-			const float deltaR = (dist1 - dist3) / (2.f * (dist1 + dist3 - 2.f * dist2));
+				const float deltaR = (dist1 - dist3) / (2.f * (dist1 + dist3 - 2.f * dist2));
 
-			if (deltaR < -1 || deltaR > 1)
-				continue;
+				if (deltaR < -1 || deltaR > 1)
+					continue;
 
-			// Re-scaled coordinate
-			float bestuR = scaleFactors[octaveL] * (suR + bestdxR + deltaR);
+				// Re-scaled coordinate
+				float bestuR = scaleFactors[octaveL] * (suR + bestdxR + deltaR);
 
-			float disparity = (uL - bestuR);
+				float disparity = (uL - bestuR);
 
-			if (disparity >= mind && disparity < maxd)
-			{
-				if (disparity <= 0)
+				if (disparity >= mind && disparity < maxd)
 				{
-					disparity = eps;
-					bestuR = uL - eps;
+					if (disparity <= 0)
+					{
+						disparity = eps;
+						bestuR = uL - eps;
+					}
+					depth[iL] = camera.bf / disparity;
+					uright[iL] = bestuR;
+					distIndices.push_back(std::make_pair(minDist, iL));
 				}
-				depth[iL] = camera.bf / disparity;
-				uright[iL] = bestuR;
-				distIndices.push_back(std::make_pair(minDist, iL));
 			}
 		}
-	}
+	};
+
+	if (pool)
+		pool->ParallelFor(nchunks, matchChunk);
+	else
+		for (int chunk = 0; chunk < nchunks; chunk++)
+			matchChunk(chunk);
+
+	// Merge in chunk order. The sort below is a total order, so the result does not depend on the threads.
+	std::vector<std::pair<int, int>>& distIndices = distIndices_;
+	distIndices.clear();
+	for (const auto& chunkDistIndices : chunkDistIndices_)
+		distIndices.insert(std::end(distIndices), std::begin(chunkDistIndices), std::end(chunkDistIndices));
+
+	if (distIndices.empty())
+		return;
 
 	std::sort(std::begin(distIndices), std::end(distIndices), std::greater<std::pair<int, int>>());
 	const int m = std::max(static_cast<int>(distIndices.size()) / 2 - 1, 0);
@@ -308,19 +431,42 @@ static int CheckOrientation(const KeyPoints& keypoints1, const KeyPoints& keypoi
 	return static_cast<int>(matchIds.size() - reduction);
 }
 
-ORBmatcher::ORBmatcher(float nnratio, bool checkOri) : fNNRatio_(nnratio), checkOrientation_(checkOri)
+int ProjectionMatcher::Search(Frame& frame, const std::vector<MapPoint*>& mappoints, float th, float nnratio)
 {
-}
-
-int ORBmatcher::SearchByProjection(Frame& frame, const std::vector<MapPoint*>& mappoints, float th)
-{
-	int nmatches = 0;
+	// Keypoints already matched to a map point are not searched
+	const auto isMatched = [&](size_t idx)
+	{
+		return frame.mappoints[idx] && frame.mappoints[idx]->Observations() > 0;
+	};
 
-	for (MapPoint* mappoint : mappoints)
+	queries_.clear();
+	for (int i = 0; i < static_cast<int>(mappoints.size()); i++)
 	{
+		MapPoint* mappoint = mappoints[i];
 		if (!mappoint->trackInView || mappoint->isBad())
 			continue;
 
+		const int cell = frame.grid.GetCellIndex(mappoint->trackProjX, mappoint->trackProjY);
+		queries_.push_back({ i, cell, 0, 0 });
+	}
+
+	const int nqueries = static_cast<int>(queries_.size());
+	if (nqueries == 0)
+		return 0;
+
+	// Visit the queries cell by cell, so that consecutive searches read the same grid cells and descriptors
+	cellOrder_.resize(nqueries);
+	for (int q = 0; q < nqueries; q++)
+		cellOrder_[q] = std::make_pair(queries_[q].cell, q);
+	std::sort(std::begin(cellOrder_), std::end(cellOrder_));
+
+	candidates_.clear();
+	for (const auto& cellQuery : cellOrder_)
+	{
+		const int q = cellQuery.second;
+		Query& query = queries_[q];
+		MapPoint* mappoint = mappoints[query.idx];
+
 		const int predictedScale = mappoint->trackScaleLevel;
 
 		// The size of the window will depend on the viewing direction
@@ -329,12 +475,45 @@ int ORBmatcher::SearchByProjection(Frame& frame, const std::vector<MapPoint*>& m
 		const float u = mappoint->trackProjX;
 		const float v = mappoint->trackProjY;
 
-		const std::vector<size_t> indices = frame.GetFeaturesInArea(u, v, radius, predictedScale - 1, predictedScale);
-		if (indices.empty())
+		const int begin = static_cast<int>(candidates_.size());
+		frame.grid.GetFeaturesInArea(u, v, radius, predictedScale - 1, predictedScale, candidates_);
+
+		// Keep the candidates that pass the checks not depending on the descriptors
+		int end = begin;
+		for (size_t k = begin; k < candidates_.size(); k++)
+		{
+			const size_t idx = candidates_[k];
+			if (isMatched(idx))
+				continue;
+
+			if (frame.uright[idx] > 0 && fabsf(mappoint->trackProjXR - frame.uright[idx]) > radius)
+				continue;
+
+			candidates_[end++] = idx;
+		}
+		candidates_.resize(end);
+
+		query.begin = begin;
+		query.end = end;
+		if (end == begin)
 			continue;
 
-		const cv::Mat desc1 = mappoint->GetDescriptor();
+		// Gather the descriptors of the candidates and compute their distances at once.
+		// The distances stay next to those of the previous queries for the assignment below.
+		const Descriptor desc1 = mappoint->GetDescriptor();
+		const int ncandidates = end - begin;
 
+		candidateDescriptors_.resize(ncandidates);
+		for (int k = 0; k < ncandidates; k++)
+			candidateDescriptors_[k] = frame.descriptors[candidates_[begin + k]];
+
+		distances_.resize(end);
+		DescriptorDistances(desc1, candidateDescriptors_.data(), ncandidates, distances_.data() + begin);
+	}
+
+	int nmatches = 0;
+	for (const Query& query : queries_)
+	{
 		int bestDist = 256;
 		int bestLevel = -1;
 		int secondbestDist = 256;
@@ -342,16 +521,14 @@ int ORBmatcher::SearchByProjection(Frame& frame, const std::vector<MapPoint*>& m
 		int bestIdx = -1;
 
 		// Get best and second matches with near keypoints
-		for (size_t idx : indices)
+		for (int k = query.begin; k < query.end; k++)
 		{
-			if (frame.mappoints[idx] && frame.mappoints[idx]->Observations() > 0)
+			// The keypoint may have been matched to a previous map point
+			const size_t idx = candidates_[k];
+			if (isMatched(idx))
 				continue;
 
-			if (frame.uright[idx] > 0 && fabsf(mappoint->trackProjXR - frame.uright[idx]) > radius)
-				continue;
-
-			const cv::Mat desc2 = frame.descriptors.row(static_cast<int>(idx));
-			const int dist = DescriptorDistance(desc1, desc2);
+			const int dist = distances_[k];
 			if (dist < bestDist)
 			{
 				secondbestDist = bestDist;
@@ -370,10 +547,10 @@ int ORBmatcher::SearchByProjection(Frame& frame, const std::vector<MapPoint*>& m
 		// Apply ratio to second match (only if best and second are in the same scale level)
 		if (bestDist <= TH_HIGH)
 		{
-			if (bestLevel == secondBestLevel && bestDist > fNNRatio_ * secondbestDist)
+			if (bestLevel == secondBestLevel && bestDist > nnratio * secondbestDist)
 				continue;
 
-			frame.mappoints[bestIdx] = mappoint;
+			frame.mappoints[bestIdx] = mappoints[query.idx];
 			nmatches++;
 		}
 	}
@@ -381,6 +558,16 @@ int ORBmatcher::SearchByProjection(Frame& frame, const std::vector<MapPoint*>& m
 	return nmatches;
 }
 
+ORBmatcher::ORBmatcher(float nnratio, bool checkOri) : fNNRatio_(nnratio), checkOrientation_(checkOri)
+{
+}
+
+int ORBmatcher::SearchByProjection(Frame& frame, const std::vector<MapPoint*>& mappoints, float th)
+{
+	ProjectionMatcher matcher;
+	return matcher.Search(frame, mappoints, th, fNNRatio_);
+}
+
 static bool CheckDistEpipolarLine(const cv::KeyPoint& keypoint1, const cv::KeyPoint& keypoint2,
 	const cv::Mat1f& F12, const KeyFrame* keyframe2)
 {
@@ -472,7 +659,7 @@ int ORBmatcher::SearchByBoW(KeyFrame* keyframe, Frame& frame, std::vector<MapPoi
 			if (!mappoint1 || mappoint1->isBad())
 				continue;
 
-			const cv::Mat desc1 = keyframe->descriptorsL.row(idx1);
+			const Descriptor& desc1 = keyframe->descriptorsL[idx1];
 
 			int bestDist = 256;
 			int bestIdx2 = -1;
@@ -483,7 +670,7 @@ int ORBmatcher::SearchByBoW(KeyFrame* keyframe, Frame& frame, std::vector<MapPoi
 				if (matches[idx2])
 					continue;
 
-				const cv::Mat desc2 = frame.descriptors.row(idx2);
+				const Descriptor& desc2 = frame.descriptors[idx2];
 				const int dist = DescriptorDistance(desc1, desc2);
 				if (dist < bestDist)
 				{
@@ -529,6 +716,7 @@ int ORBmatcher::SearchByProjection(const KeyFrame* keyframe, const Sim3& Scw, co
 	alreadyFound.erase(nullptr);
 
 	int nmatches = 0;
+	std::vector<size_t> indices;
 
 	// For each Candidate MapPoint Project and Match
 	for (MapPoint* mappoint : mappoints)
@@ -574,12 +762,13 @@ int ORBmatcher::SearchByProjection(const KeyFrame* keyframe, const Sim3& Scw, co
 		// Search in a radius
 		const float radius = th * keyframe->pyramid.scaleFactors[predictedScale];
 
-		const std::vector<size_t> indices = keyframe->GetFeaturesInArea(u, v, radius);
+		indices.clear();
+		keyframe->GetFeaturesInArea(u, v, radius, indices);
 		if (indices.empty())
 			continue;
 
 		// Match to the most similar keypoint in the radius
-		const cv::Mat desc1 = mappoint->GetDescriptor();
+		const Descriptor desc1 = mappoint->GetDescriptor();
 
 		int bestDist = 256;
 		int bestIdx = -1;
@@ -592,7 +781,7 @@ int ORBmatcher::SearchByProjection(const KeyFrame* keyframe, const Sim3& Scw, co
 			if (scale < predictedScale - 1 || scale > predictedScale)
 				continue;
 
-			const cv::Mat desc2 = keyframe->descriptorsL.row(static_cast<int>(idx));
+			const Descriptor& desc2 = keyframe->descriptorsL[idx];
 			const int dist = DescriptorDistance(desc1, desc2);
 			if (dist < bestDist)
 			{
@@ -615,6 +804,7 @@ int ORBmatcher::SearchForInitialization(Frame& frame1, Frame& frame2, std::vecto
 	std::vector<int>& matches12, int windowSize)
 {
 	int nmatches = 0;
+	std::vector<size_t> indices2;
 	matches12.assign(frame1.keypointsUn.size(), -1);
 
 	std::vector<int> matchedDistance(frame2.keypointsUn.size(), std::numeric_limits<int>::max());
@@ -634,11 +824,12 @@ int ORBmatcher::SearchForInitialization(Frame& frame1, Frame& frame2, std::vecto
 
 		const float u = prevMatched[idx1].x;
 		const float v = prevMatched[idx1].y;
-		const std::vector<size_t> indices2 = frame2.GetFeaturesInArea(u, v, radius, level1, level1);
+		indices2.clear();
+		frame2.GetFeaturesInArea(u, v, radius, level1, level1, indices2);
 		if (indices2.empty())
 			continue;
 
-		const cv::Mat desc1 = frame1.descriptors.row(static_cast<int>(idx1));
+		const Descriptor& desc1 = frame1.descriptors[idx1];
 
 		int bestDist = std::numeric_limits<int>::max();
 		int secondBestDist = std::numeric_limits<int>::max();
@@ -646,7 +837,7 @@ int ORBmatcher::SearchForInitialization(Frame& frame1, Frame& frame2, std::vecto
 
 		for (size_t idx2 : indices2)
 		{
-			const cv::Mat desc2 = frame2.descriptors.row(static_cast<int>(idx2));
+			const Descriptor& desc2 = frame2.descriptors[idx2];
 			const int dist = DescriptorDistance(desc1, desc2);
 
 			if (matchedDistance[idx2] <= dist)
@@ -699,8 +890,8 @@ int ORBmatcher::SearchByBoW(KeyFrame* keyframe1, KeyFrame* keyframe2, std::vecto
 	const KeyPoints& keypoints2 = keyframe2->keypointsUn;
 	const std::vector<MapPoint*> mappoints1 = keyframe1->GetMapPointMatches();
 	const std::vector<MapPoint*> mappoints2 = keyframe2->GetMapPointMatches();
-	const cv::Mat& descriptors1 = keyframe1->descriptorsL;
-	const cv::Mat& descriptors2 = keyframe2->descriptorsL;
+	const Descriptors& descriptors1 = keyframe1->descriptorsL;
+	const Descriptors& descriptors2 = keyframe2->descriptorsL;
 
 	int nmatches = 0;
 
@@ -721,7 +912,7 @@ int ORBmatcher::SearchByBoW(KeyFrame* keyframe1, KeyFrame* keyframe2, std::vecto
 			if (!mappoint1 || mappoint1->isBad())
 				continue;
 
-			const cv::Mat desc1 = descriptors1.row(idx1);
+			const Descriptor& desc1 = descriptors1[idx1];
 
 			int bestDist = 256;
 			int bestIdx2 = -1;
@@ -733,7 +924,7 @@ int ORBmatcher::SearchByBoW(KeyFrame* keyframe1, KeyFrame* keyframe2, std::vecto
 				if (matched2[idx2] || !mappoint2 || mappoint2->isBad())
 					continue;
 
-				const cv::Mat desc2 = descriptors2.row(idx2);
+				const Descriptor& desc2 = descriptors2[idx2];
 				const int dist = DescriptorDistance(desc1, desc2);
 				if (dist < bestDist)
 				{
@@ -801,7 +992,7 @@ int ORBmatcher::SearchForTriangulation(const KeyFrame* keyframe1, const KeyFrame
 				continue;
 
 			const cv::KeyPoint& keypoint1 = keyframe1->keypointsUn[idx1];
-			const cv::Mat desc1 = keyframe1->descriptorsL.row(idx1);
+			const Descriptor& desc1 = keyframe1->descriptorsL[idx1];
 
 			int bestDist = TH_LOW;
 			int bestIdx2 = -1;
@@ -818,7 +1009,7 @@ int ORBmatcher::SearchForTriangulation(const KeyFrame* keyframe1, const KeyFrame
 				if (onlyStereo && !stereo2)
 					continue;
 
-				const cv::Mat desc2 = keyframe2->descriptorsL.row(idx2);
+				const Descriptor& desc2 = keyframe2->descriptorsL[idx2];
 				const int dist = DescriptorDistance(desc1, desc2);
 				if (dist > TH_LOW || dist > bestDist)
 					continue;
@@ -866,13 +1057,22 @@ int ORBmatcher::SearchForTriangulation(const KeyFrame* keyframe1, const KeyFrame
 }
 
 int ORBmatcher::Fuse(KeyFrame* keyframe, const std::vector<MapPoint*>& mappoints, float th)
+{
+	std::vector<FuseMatch> matches;
+	FuseSearch(keyframe, mappoints, 0, mappoints.size(), matches, th);
+	return FuseApply(keyframe, matches);
+}
+
+void ORBmatcher::FuseSearch(KeyFrame* keyframe, const std::vector<MapPoint*>& mappoints, size_t begin, size_t end,
+	std::vector<FuseMatch>& matches, float th) const
 {
 	const CameraProjection proj(keyframe->GetPose(), keyframe->camera);
 	const Vec3D Ow = keyframe->GetCameraCenter();
-	int nfused = 0;
+	std::vector<size_t> indices;
 
-	for (MapPoint* mappoint : mappoints)
+	for (size_t i = begin; i < end; i++)
 	{
+		MapPoint* mappoint = mappoints[i];
 		if (!mappoint || mappoint->isBad() || mappoint->IsInKeyFrame(keyframe))
 			continue;
 
@@ -912,13 +1112,14 @@ int ORBmatcher::Fuse(KeyFrame* keyframe, const std::vector<MapPoint*>& mappoints
 		// Search in a radius
 		const float radius = th * keyframe->pyramid.scaleFactors[predictedScale];
 
-		const std::vector<size_t> indices = keyframe->GetFeaturesInArea(u, v, radius);
+		indices.clear();
+		keyframe->GetFeaturesInArea(u, v, radius, indices);
 		if (indices.empty())
 			continue;
 
 		// Match to the most similar keypoint in the radius
 
-		const cv::Mat desc1 = mappoint->GetDescriptor();
+		const Descriptor desc1 = mappoint->GetDescriptor();
 
 		int bestDist = 256;
 		int bestIdx = -1;
@@ -944,7 +1145,7 @@ int ORBmatcher::Fuse(KeyFrame* keyframe, const std::vector<MapPoint*>& mappoints
 					continue;
 			}
 
-			const cv::Mat desc2 = keyframe->descriptorsL.row(static_cast<int>(idx));
+			const Descriptor& desc2 = keyframe->descriptorsL[idx];
 			const int dist = DescriptorDistance(desc1, desc2);
 			if (dist < bestDist)
 			{
@@ -953,27 +1154,40 @@ int ORBmatcher::Fuse(KeyFrame* keyframe, const std::vector<MapPoint*>& mappoints
 			}
 		}
 
-		// If there is already a MapPoint replace otherwise add new measurement
 		if (bestDist <= TH_LOW)
+			matches.push_back(std::make_pair(mappoint, bestIdx));
+	}
+}
+
+int ORBmatcher::FuseApply(KeyFrame* keyframe, const std::vector<FuseMatch>& matches)
+{
+	int nfused = 0;
+	for (const FuseMatch& match : matches)
+	{
+		MapPoint* mappoint = match.first;
+		const int bestIdx = match.second;
+
+		if (mappoint->isBad() || mappoint->IsInKeyFrame(keyframe))
+			continue;
+
+		// If there is already a MapPoint replace otherwise add new measurement
+		MapPoint* MPInKF = keyframe->GetMapPoint(bestIdx);
+		if (MPInKF)
 		{
-			MapPoint* MPInKF = keyframe->GetMapPoint(bestIdx);
-			if (MPInKF)
-			{
-				if (!MPInKF->isBad())
-				{
-					if (MPInKF->Observations() > mappoint->Observations())
-						mappoint->Replace(MPInKF);
-					else
-						MPInKF->Replace(mappoint);
-				}
-			}
-			else
+			if (!MPInKF->isBad())
 			{
-				mappoint->AddObservation(keyframe, bestIdx);
-				keyframe->AddMapPoint(mappoint, bestIdx);
+				if (MPInKF->Observations() > mappoint->Observations())
+					mappoint->Replace(MPInKF);
+				else
+					MPInKF->Replace(mappoint);
 			}
-			nfused++;
 		}
+		else
+		{
+			mappoint->AddObservation(keyframe, bestIdx);
+			keyframe->AddMapPoint(mappoint, bestIdx);
+		}
+		nfused++;
 	}
 
 	return nfused;
@@ -992,6 +1206,7 @@ int ORBmatcher::Fuse(KeyFrame* keyframe, const Sim3& Scw, const std::vector<MapP
 	const std::set<MapPoint*> alreadyFound = keyframe->GetMapPoints();
 
 	int nfused = 0;
+	std::vector<size_t> indices;
 
 	// For each candidate MapPoint project and match
 	//for (MapPoint* mappoint : mappoints)
@@ -1041,13 +1256,14 @@ int ORBmatcher::Fuse(KeyFrame* keyframe, const Sim3& Scw, const std::vector<MapP
 		// Search in a radius
 		const float radius = th*keyframe->pyramid.scaleFactors[predictedScale];
 
-		const std::vector<size_t> indices = keyframe->GetFeaturesInArea(u, v, radius);
+		indices.clear();
+		keyframe->GetFeaturesInArea(u, v, radius, indices);
 		if (indices.empty())
 			continue;
 
 		// Match to the most similar keypoint in the radius
 
-		const cv::Mat desc1 = mappoint->GetDescriptor();
+		const Descriptor desc1 = mappoint->GetDescriptor();
 
 		int bestDist = std::numeric_limits<int>::max();
 		int bestIdx = -1;
@@ -1057,7 +1273,7 @@ int ORBmatcher::Fuse(KeyFrame* keyframe, const Sim3& Scw, const std::vector<MapP
 			if (scale < predictedScale - 1 || scale > predictedScale)
 				continue;
 
-			const cv::Mat &desc2 = keyframe->descriptorsL.row(static_cast<int>(idx));
+			const Descriptor& desc2 = keyframe->descriptorsL[idx];
 			int dist = DescriptorDistance(desc1, desc2);
 			if (dist < bestDist)
 			{
@@ -1122,6 +1338,7 @@ int ORBmatcher::SearchBySim3(KeyFrame* keyframe1, KeyFrame* keyframe2, std::vect
 
 	std::vector<int> match1(N1, -1);
 	std::vector<int> match2(N2, -1);
+	std::vector<size_t> indices;
 
 	// Transform from KF1 to KF2 and search
 	for (int i1 = 0; i1 < N1; i1++)
@@ -1160,12 +1377,13 @@ int ORBmatcher::SearchBySim3(KeyFrame* keyframe1, KeyFrame* keyframe2, std::vect
 		// Search in a radius
 		const float radius = th*keyframe2->pyramid.scaleFactors[predictedScale];
 
-		const std::vector<size_t> indices = keyframe2->GetFeaturesInArea(u, v, radius);
+		indices.clear();
+		keyframe2->GetFeaturesInArea(u, v, radius, indices);
 		if (indices.empty())
 			continue;
 
 		// Match to the most similar keypoint in the radius
-		const cv::Mat desc1 = mappoint1->GetDescriptor();
+		const Descriptor desc1 = mappoint1->GetDescriptor();
 
 		int bestDist = std::numeric_limits<int>::max();
 		int bestIdx = -1;
@@ -1175,7 +1393,7 @@ int ORBmatcher::SearchBySim3(KeyFrame* keyframe1, KeyFrame* keyframe2, std::vect
 			if (keypoint2.octave < predictedScale - 1 || keypoint2.octave > predictedScale)
 				continue;
 
-			const cv::Mat desc2 = keyframe2->descriptorsL.row(static_cast<int>(idx));
+			const Descriptor& desc2 = keyframe2->descriptorsL[idx];
 			const int dist = DescriptorDistance(desc1, desc2);
 			if (dist < bestDist)
 			{
@@ -1227,12 +1445,13 @@ int ORBmatcher::SearchBySim3(KeyFrame* keyframe1, KeyFrame* keyframe2, std::vect
 		// Search in a radius of 2.5*sigma(ScaleLevel)
 		const float radius = th * keyframe1->pyramid.scaleFactors[predictedScale];
 
-		const std::vector<size_t> indices = keyframe1->GetFeaturesInArea(u, v, radius);
+		indices.clear();
+		keyframe1->GetFeaturesInArea(u, v, radius, indices);
 		if (indices.empty())
 			continue;
 
 		// Match to the most similar keypoint in the radius
-		const cv::Mat desc2 = mappoint2->GetDescriptor();
+		const Descriptor desc2 = mappoint2->GetDescriptor();
 
 		int bestDist = std::numeric_limits<int>::max();
 		int bestIdx = -1;
@@ -1242,7 +1461,7 @@ int ORBmatcher::SearchBySim3(KeyFrame* keyframe1, KeyFrame* keyframe2, std::vect
 			if (keypoints1.octave < predictedScale - 1 || keypoints1.octave > predictedScale)
 				continue;
 
-			const cv::Mat desc1 = keyframe1->descriptorsL.row(static_cast<int>(idx));
+			const Descriptor& desc1 = keyframe1->descriptorsL[idx];
 			const int dist = DescriptorDistance(desc2, desc1);
 			if (dist < bestDist)
 			{
@@ -1279,6 +1498,7 @@ int ORBmatcher::SearchBySim3(KeyFrame* keyframe1, KeyFrame* keyframe2, std::vect
 int ORBmatcher::SearchByProjection(Frame& currFrame, const Frame& lastFrame, float th, bool monocular)
 {
 	int nmatches = 0;
+	std::vector<size_t> indices2;
 
 	const CameraParams& camera = currFrame.camera;
 	const CameraProjection proj(currFrame.pose, camera);
@@ -1318,11 +1538,12 @@ int ORBmatcher::SearchByProjection(Frame& currFrame, const Frame& lastFrame, flo
 		const int minLevel = forward ? octave1 : (backward ? 0       : octave1 - 1);
 		const int maxLevel = forward ? -1      : (backward ? octave1 : octave1 + 1);
 
-		const std::vector<size_t> indices2 = currFrame.GetFeaturesInArea(u, v, radius, minLevel, maxLevel);
+		indices2.clear();
+		currFrame.GetFeaturesInArea(u, v, radius, minLevel, maxLevel, indices2);
 		if (indices2.empty())
 			continue;
 
-		const cv::Mat desc1 = mappoint1->GetDescriptor();
+		const Descriptor desc1 = mappoint1->GetDescriptor();
 
 		int bestDist = 256;
 		int bestIdx2 = -1;
@@ -1335,7 +1556,7 @@ int ORBmatcher::SearchByProjection(Frame& currFrame, const Frame& lastFrame, flo
 			if (currFrame.uright[idx2] > 0 && fabsf(ur - currFrame.uright[idx2]) > radius)
 				continue;
 
-			const cv::Mat desc2 = currFrame.descriptors.row(static_cast<int>(idx2));
+			const Descriptor& desc2 = currFrame.descriptors[idx2];
 			const int dist = DescriptorDistance(desc1, desc2);
 			if (dist < bestDist)
 			{
@@ -1365,6 +1586,7 @@ int ORBmatcher::SearchByProjection(Frame& frame, KeyFrame* keyframe, const std::
 	float th, int ORBdist)
 {
 	int nmatches = 0;
+	std::vector<size_t> indices;
 
 	const CameraProjection proj(frame.pose, frame.camera);
 	const Point3D Ow = frame.GetCameraCenter();
@@ -1405,11 +1627,12 @@ int ORBmatcher::SearchByProjection(Frame& frame, KeyFrame* keyframe, const std::
 		// Search in a window
 		const float radius = th * frame.pyramid.scaleFactors[predictedScale];
 
-		const std::vector<size_t> indices = frame.GetFeaturesInArea(u, v, radius, predictedScale - 1, predictedScale + 1);
+		indices.clear();
+		frame.GetFeaturesInArea(u, v, radius, predictedScale - 1, predictedScale + 1, indices);
 		if (indices.empty())
 			continue;
 
-		const cv::Mat desc1 = mappoint->GetDescriptor();
+		const Descriptor desc1 = mappoint->GetDescriptor();
 
 		int bestDist = 256;
 		int bestIdx2 = -1;
@@ -1419,7 +1642,7 @@ int ORBmatcher::SearchByProjection(Frame& frame, KeyFrame* keyframe, const std::
 			if (frame.mappoints[idx2])
 				continue;
 
-			const cv::Mat desc2 = frame.descriptors.row(static_cast<int>(idx2));
+			const Descriptor& desc2 = frame.descriptors[idx2];
 			const int dist = DescriptorDistance(desc1, desc2);
 			if (dist < bestDist)
 			{
@@ -1444,16 +1667,14 @@ int ORBmatcher::SearchByProjection(Frame& frame, KeyFrame* keyframe, const std::
 	return nmatches;
 }
 
-// Bit set count operation from
-// http://graphics.stanford.edu/~seander/bithacks.html#CountBitsSetParallel
+int ORBmatcher::DescriptorDistance(const Descriptor& a, const Descriptor& b)
+{
+	return ORB_SLAM2::DescriptorDistance(a, b);
+}
+
 int ORBmatcher::DescriptorDistance(const cv::Mat& a, const cv::Mat& b)
 {
-	const int* ptra = a.ptr<int32_t>();
-	const int* ptrb = b.ptr<int32_t>();
-	int dist = 0;
-	for (int i = 0; i < 8; i++)
-		dist += static_cast<int>(popcnt32(*ptra++ ^ *ptrb++));
-	return dist;
+	return ORB_SLAM2::DescriptorDistance(a.ptr<uint8_t>(), b.ptr<uint8_t>());
 }
 
 } //namespace ORB_SLAM
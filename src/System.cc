@@ -22,6 +22,9 @@
 
 #include <thread>
 #include <iomanip>
+#include <chrono>
+
+#include <opencv2/opencv.hpp>
 
 #include "Frame.h"
 #include "KeyFrame.h"
@@ -36,6 +39,8 @@
 #include "Converter.h"
 #include "ORBextractor.h"
 #include "ORBmatcher.h"
+#include "ThreadPool.h"
+#include "DescriptorDistance.h"
 
 namespace ORB_SLAM2
 {
@@ -81,17 +86,111 @@ static ORBextractor::Parameters ReadExtractorParams(const cv::FileStorage& fs)
 	param.nlevels = fs["ORBextractor.nLevels"];
 	param.iniThFAST = fs["ORBextractor.iniThFAST"];
 	param.minThFAST = fs["ORBextractor.minThFAST"];
+	param.nthreads = std::max(static_cast<int>(fs["ORBextractor.nThreads"]), 1);
+	if (!fs["ORBextractor.descriptorMode"].empty())
+		param.descriptorMode = fs["ORBextractor.descriptorMode"];
+	if (!fs["ORBextractor.thresholdMemory"].empty())
+		param.thresholdMemory = static_cast<int>(fs["ORBextractor.thresholdMemory"]) != 0;
 	return param;
 }
 
+// Sets the detection mask of an extractor, if the settings give an image file for it
+static void ReadExtractorMask(const cv::FileStorage& fs, const char* key, ORBextractor& extractor)
+{
+	if (fs[key].empty())
+		return;
+
+	const std::string maskFile = fs[key];
+	const cv::Mat mask = cv::imread(maskFile, cv::IMREAD_GRAYSCALE);
+	if (mask.empty())
+	{
+		std::cerr << "Failed to open mask at: " << maskFile << std::endl;
+		std::exit(-1);
+	}
+
+	std::cout << "Mask loaded from: " << maskFile << std::endl;
+	extractor.SetMask(mask);
+}
+
+struct FeatureBudgetParams
+{
+	bool enabled;
+	int minFeatures;
+	int maxFeatures;
+	int lowInliers;
+	int highInliers;
+	int holdFrames;
+	float targetTime;
+	int iniThFAST;
+	int minThFAST;
+};
+
+static int ReadInt(const cv::FileStorage& fs, const char* key, int defaultValue)
+{
+	return fs[key].empty() ? defaultValue : static_cast<int>(fs[key]);
+}
+
+static FeatureBudgetParams ReadFeatureBudgetParams(const cv::FileStorage& fs, const ORBextractor::Parameters& extractorParams)
+{
+	FeatureBudgetParams param;
+	param.enabled = ReadInt(fs, "FeatureBudget.enabled", 0) != 0;
+	param.maxFeatures = extractorParams.nfeatures;
+	param.minFeatures = std::min(ReadInt(fs, "FeatureBudget.minFeatures", param.maxFeatures / 2), param.maxFeatures);
+	param.lowInliers = ReadInt(fs, "FeatureBudget.lowInliers", 100);
+	param.highInliers = std::max(ReadInt(fs, "FeatureBudget.highInliers", 250), param.lowInliers);
+	param.holdFrames = std::max(ReadInt(fs, "FeatureBudget.holdFrames", 10), 1);
+	param.targetTime = fs["FeatureBudget.targetTime"];
+	param.iniThFAST = extractorParams.iniThFAST;
+	param.minThFAST = extractorParams.minThFAST;
+	return param;
+}
+
+// Number of threads of the pool shared by the extraction, the stereo matching, the undistortion and the local mapping.
+// System.nThreads: 0 uses every core. If not given, ORBextractor.nThreads (two at least for stereo).
+static int ReadNumThreads(const cv::FileStorage& fs, const ORBextractor::Parameters& extractorParams, int sensor)
+{
+	if (fs["System.nThreads"].empty())
+		return sensor == System::STEREO ? std::max(extractorParams.nthreads, 2) : extractorParams.nthreads;
+
+	const int nthreads = fs["System.nThreads"];
+	return nthreads > 0 ? nthreads : std::max(static_cast<int>(std::thread::hardware_concurrency()), 1);
+}
+
 static float ReadDepthFactor(const cv::FileStorage& fs)
 {
 	const float factor = fs["DepthMapFactor"];
 	return fabs(factor) < 1e-5 ? 1 : 1.f / factor;
 }
 
+// Relative difference to the median of the 3x3 neighborhood above which a depth is rejected (0 disables the check)
+static float ReadDepthMedianTolerance(const cv::FileStorage& fs)
+{
+	return fs["DepthMapMedianTolerance"].empty() ? 0.f : static_cast<float>(fs["DepthMapMedianTolerance"]);
+}
+
+static const char* const INPUT_FORMAT_NAMES[] =
+{
+	"COLOR", "NV12", "NV21", "I420", "YUYV", "UYVY", "BayerBG", "BayerGB", "BayerRG", "BayerGR"
+};
+
+// Reads Camera.format, one of INPUT_FORMAT_NAMES (COLOR if not given)
+static System::InputFormat ReadInputFormat(const cv::FileStorage& fs)
+{
+	if (fs["Camera.format"].empty())
+		return System::INPUT_COLOR;
+
+	const std::string name = fs["Camera.format"];
+	for (int format = System::INPUT_COLOR; format <= System::INPUT_BAYER_GR; format++)
+		if (name == INPUT_FORMAT_NAMES[format])
+			return static_cast<System::InputFormat>(format);
+
+	std::cerr << "Unknown Camera.format: " << name << std::endl;
+	std::exit(-1);
+}
+
 static void PrintSettings(const CameraParams& camera, const cv::Mat1f& distCoeffs,
-	float fps, bool rgb, const ORBextractor::Parameters& param, float thDepth, int sensor)
+	float fps, bool rgb, System::InputFormat format, const ORBextractor::Parameters& param, const FeatureBudgetParams& budget, float thDepth, int sensor,
+	int nthreads)
 {
 	std::cout << std::endl << "Camera Parameters: " << std::endl;
 	std::cout << "- fx: " << camera.fx << std::endl;
@@ -107,6 +206,7 @@ static void PrintSettings(const CameraParams& camera, const cv::Mat1f& distCoeff
 	std::cout << "- fps: " << fps << std::endl;
 
 	std::cout << "- color order: " << (rgb ? "RGB" : "BGR") << " (ignored if grayscale)" << std::endl;
+	std::cout << "- format: " << INPUT_FORMAT_NAMES[format] << std::endl;
 
 	std::cout << std::endl << "ORB Extractor Parameters: " << std::endl;
 	std::cout << "- Number of Features: " << param.nfeatures << std::endl;
@@ -114,14 +214,56 @@ static void PrintSettings(const CameraParams& camera, const cv::Mat1f& distCoeff
 	std::cout << "- Scale Factor: " << param.scaleFactor << std::endl;
 	std::cout << "- Initial Fast Threshold: " << param.iniThFAST << std::endl;
 	std::cout << "- Minimum Fast Threshold: " << param.minThFAST << std::endl;
+	std::cout << "- Descriptor Mode: " << (param.descriptorMode == ORBextractor::DESCRIPTOR_REFERENCE ? "reference" :
+		param.descriptorMode == ORBextractor::DESCRIPTOR_QUANTIZED ? "quantized" : "exact") << std::endl;
+	std::cout << "- Threshold Memory: " << (param.thresholdMemory ? "on" : "off") << std::endl;
+	std::cout << "- Descriptor Distance: " << DescriptorDistanceBackend() << std::endl;
+
+	if (budget.enabled)
+	{
+		std::cout << std::endl << "Feature Budget Parameters: " << std::endl;
+		std::cout << "- Number of Features: " << budget.minFeatures << " - " << budget.maxFeatures << std::endl;
+		std::cout << "- Tracking Inliers (Low/High): " << budget.lowInliers << " / " << budget.highInliers << std::endl;
+		std::cout << "- Hold Frames: " << budget.holdFrames << std::endl;
+		if (budget.targetTime > 0)
+			std::cout << "- Target Extraction Time: " << budget.targetTime << " ms" << std::endl;
+	}
 
 	if (sensor == System::STEREO || sensor == System::RGBD)
 		std::cout << std::endl << "Depth Threshold (Close/Far Points): " << thDepth << std::endl;
+
+	std::cout << std::endl << "Number of Threads (Extraction/Stereo/Undistortion): " << nthreads << std::endl;
 }
 
-static void ConvertToGray(const cv::Mat& src, cv::Mat& dst, bool RGB)
+static void ConvertToGray(const cv::Mat& src, cv::Mat& dst, bool RGB, System::InputFormat format)
 {
 	static const int codes[] = { cv::COLOR_RGB2GRAY, cv::COLOR_BGR2GRAY, cv::COLOR_RGBA2GRAY, cv::COLOR_BGRA2GRAY };
+	static const int bayerCodes[] = { cv::COLOR_BayerBG2GRAY, cv::COLOR_BayerGB2GRAY, cv::COLOR_BayerRG2GRAY, cv::COLOR_BayerGR2GRAY };
+
+	switch (format)
+	{
+	case System::INPUT_NV12:
+	case System::INPUT_NV21:
+	case System::INPUT_I420:
+		// The luma is the first 2/3 of the rows
+		CV_Assert(src.type() == CV_8U && src.rows % 3 == 0);
+		dst = src.rowRange(0, src.rows * 2 / 3);
+		return;
+	case System::INPUT_YUYV:
+	case System::INPUT_UYVY:
+		CV_Assert(src.type() == CV_8UC2);
+		cv::extractChannel(src, dst, format == System::INPUT_YUYV ? 0 : 1);
+		return;
+	case System::INPUT_BAYER_BG:
+	case System::INPUT_BAYER_GB:
+	case System::INPUT_BAYER_RG:
+	case System::INPUT_BAYER_GR:
+		CV_Assert(src.type() == CV_8U);
+		cv::cvtColor(src, dst, bayerCodes[format - System::INPUT_BAYER_BG]);
+		return;
+	default:
+		break;
+	}
 
 	const int ch = src.channels();
 	CV_Assert(ch == 1 || ch == 3 || ch == 4);
@@ -147,10 +289,110 @@ static void GetScalePyramidInfo(const ORBextractor& extractor, ScalePyramidInfo&
 	pyramid.invSigmaSq = extractor.GetInverseScaleSigmaSquares();
 }
 
+// Undistortion of the nodes of a regular grid over the image, precomputed for a calibration.
+// A point is undistorted by bilinear interpolation of the 4 nodes around it.
+class UndistortionMap
+{
+public:
+
+	UndistortionMap() : step_(0) {}
+
+	// Builds the map for the given image size with the finest grid step that is needed to stay within MAX_ERROR pixels
+	// of the exact solver, measured at the cell centers, where the interpolation error is the largest.
+	// If even a 1 pixel step is not accurate enough, the map stays empty.
+	void Create(const cv::Size& imageSize, const cv::Mat& K, const cv::Mat1f& distCoeffs)
+	{
+		const double MAX_ERROR = 0.01;
+
+		imageSize_ = imageSize;
+		map_.release();
+		step_ = 0;
+
+		for (int step = 8; step >= 1; step /= 2)
+		{
+			// Grid nodes up to the first node past the last pixel
+			const int cols = (imageSize.width - 1) / step + 2;
+			const int rows = (imageSize.height - 1) / step + 2;
+
+			std::vector<cv::Point2f> nodes, centers;
+			nodes.reserve(rows * cols);
+			centers.reserve((rows - 1) * (cols - 1));
+			for (int y = 0; y < rows; y++)
+				for (int x = 0; x < cols; x++)
+					nodes.push_back(cv::Point2f(1.f * x * step, 1.f * y * step));
+			for (int y = 0; y + 1 < rows; y++)
+				for (int x = 0; x + 1 < cols; x++)
+					centers.push_back(cv::Point2f((x + 0.5f) * step, (y + 0.5f) * step));
+
+			std::vector<cv::Point2f> exact(centers);
+			cv::undistortPoints(nodes, nodes, K, distCoeffs, cv::Mat(), K);
+			cv::undistortPoints(exact, exact, K, distCoeffs, cv::Mat(), K);
+
+			map_ = cv::Mat2f(rows, cols, reinterpret_cast<cv::Vec2f*>(nodes.data())).clone();
+			step_ = step;
+
+			// Accuracy report
+			double maxError = 0, sumError = 0;
+			for (size_t i = 0; i < centers.size(); i++)
+			{
+				const double error = cv::norm(Undistort(centers[i]) - exact[i]);
+				maxError = std::max(maxError, error);
+				sumError += error;
+			}
+
+			std::cout << "Undistortion map: " << cols << "x" << rows << " nodes every " << step << " px, error (mean/max): "
+				<< sumError / centers.size() << " / " << maxError << " px" << std::endl;
+
+			if (maxError <= MAX_ERROR)
+				return;
+		}
+
+		std::cout << "Undistortion map not accurate enough, the exact solver is used" << std::endl;
+		map_.release();
+		step_ = 0;
+	}
+
+	void Clear()
+	{
+		*this = UndistortionMap();
+	}
+
+	bool Empty() const { return map_.empty(); }
+	const cv::Size& GetImageSize() const { return imageSize_; }
+
+	cv::Point2f Undistort(const cv::Point2f& pt) const
+	{
+		const float scale = 1.f / step_;
+		const float fx = std::min(std::max(scale * pt.x, 0.f), map_.cols - 1.f);
+		const float fy = std::min(std::max(scale * pt.y, 0.f), map_.rows - 1.f);
+		const int x = std::min(static_cast<int>(fx), map_.cols - 2);
+		const int y = std::min(static_cast<int>(fy), map_.rows - 2);
+		const float ax = fx - x;
+		const float ay = fy - y;
+
+		const cv::Vec2f& p00 = map_(y, x);
+		const cv::Vec2f& p01 = map_(y, x + 1);
+		const cv::Vec2f& p10 = map_(y + 1, x);
+		const cv::Vec2f& p11 = map_(y + 1, x + 1);
+		const float w00 = (1 - ax) * (1 - ay), w01 = ax * (1 - ay), w10 = (1 - ax) * ay, w11 = ax * ay;
+		return cv::Point2f(
+			w00 * p00[0] + w01 * p01[0] + w10 * p10[0] + w11 * p11[0],
+			w00 * p00[1] + w01 * p01[1] + w10 * p10[1] + w11 * p11[1]);
+	}
+
+private:
+
+	cv::Mat2f map_;
+	int step_;
+	cv::Size imageSize_;
+};
+
 // Undistort keypoints given OpenCV distortion parameters.
 // Only for the RGB-D case. Stereo must be already rectified!
 // (called in the constructor).
-static void UndistortKeyPoints(const KeyPoints& src, KeyPoints& dst, const cv::Mat& K, const cv::Mat1f& distCoeffs)
+// The precomputed map is used if there is one, else chunks of keypoints are undistorted concurrently on the pool.
+static void UndistortKeyPoints(const KeyPoints& src, KeyPoints& dst, const cv::Mat& K, const cv::Mat1f& distCoeffs,
+	const UndistortionMap& map, ThreadPool& pool)
 {
 	if (distCoeffs(0) == 0.f)
 	{
@@ -158,19 +400,41 @@ static void UndistortKeyPoints(const KeyPoints& src, KeyPoints& dst, const cv::M
 		return;
 	}
 
-	std::vector<cv::Point2f> points(src.size());
-	for (size_t i = 0; i < src.size(); i++)
-		points[i] = src[i].pt;
+	if (!map.Empty())
+	{
+		dst.resize(src.size());
+		for (size_t i = 0; i < src.size(); i++)
+		{
+			cv::KeyPoint keypoint = src[i];
+			keypoint.pt = map.Undistort(keypoint.pt);
+			dst[i] = keypoint;
+		}
+		return;
+	}
 
-	cv::undistortPoints(points, points, K, distCoeffs, cv::Mat(), K);
+	const int CHUNK_SIZE = 256;
+	const int npoints = static_cast<int>(src.size());
+	const int nchunks = (npoints + CHUNK_SIZE - 1) / CHUNK_SIZE;
 
 	dst.resize(src.size());
-	for (size_t i = 0; i < src.size(); i++)
+	pool.ParallelFor(nchunks, [&](int chunk)
 	{
-		cv::KeyPoint keypoint = src[i];
-		keypoint.pt = points[i];
-		dst[i] = keypoint;
-	}
+		const int first = chunk * CHUNK_SIZE;
+		const int last = std::min(first + CHUNK_SIZE, npoints);
+
+		std::vector<cv::Point2f> points(last - first);
+		for (int i = first; i < last; i++)
+			points[i - first] = src[i].pt;
+
+		cv::undistortPoints(points, points, K, distCoeffs, cv::Mat(), K);
+
+		for (int i = first; i < last; i++)
+		{
+			cv::KeyPoint keypoint = src[i];
+			keypoint.pt = points[i - first];
+			dst[i] = keypoint;
+		}
+	});
 }
 
 // Computes image bounds for the undistorted image (called in the constructor).
@@ -193,9 +457,36 @@ static ImageBounds ComputeImageBounds(const cv::Mat& image, const cv::Mat& K, co
 	return imageBounds;
 }
 
-// Associate a "right" coordinate to a keypoint if there is valid depth in the depthmap.
+// Depth of the pixel (u, v) of the raw depthmap, scaled by factor.
+// If medianTolerance > 0, the depth is rejected (0 returned) when it differs from the median of the valid depths
+// of its 3x3 neighborhood by more than medianTolerance times the median, as the flying pixels at depth edges do.
+template <typename T>
+static float SampleDepth(const cv::Mat& depthImage, int u, int v, float factor, float medianTolerance)
+{
+	const float d = factor * depthImage.at<T>(v, u);
+	if (d <= 0 || medianTolerance <= 0)
+		return d;
+
+	float neighbors[9];
+	int nneighbors = 0;
+	for (int y = std::max(v - 1, 0); y <= std::min(v + 1, depthImage.rows - 1); y++)
+	{
+		for (int x = std::max(u - 1, 0); x <= std::min(u + 1, depthImage.cols - 1); x++)
+		{
+			const float neighbor = factor * depthImage.at<T>(y, x);
+			if (neighbor > 0)
+				neighbors[nneighbors++] = neighbor;
+		}
+	}
+
+	std::nth_element(neighbors, neighbors + nneighbors / 2, neighbors + nneighbors);
+	const float median = neighbors[nneighbors / 2];
+	return std::abs(d - median) <= medianTolerance * median ? d : 0.f;
+}
+
+template <typename T>
 static void ComputeStereoFromRGBD(const KeyPoints& keypoints, const KeyPoints& keypointsUn, const cv::Mat& depthImage,
-	const CameraParams& camera, std::vector<float>& uright, std::vector<float>& depth)
+	float depthFactor, float medianTolerance, const CameraParams& camera, std::vector<float>& uright, std::vector<float>& depth)
 {
 	const int nkeypoints = static_cast<int>(keypoints.size());
 
@@ -209,7 +500,7 @@ static void ComputeStereoFromRGBD(const KeyPoints& keypoints, const KeyPoints& k
 
 		const int v = static_cast<int>(keypoint.pt.y);
 		const int u = static_cast<int>(keypoint.pt.x);
-		const float d = depthImage.at<float>(v, u);
+		const float d = SampleDepth<T>(depthImage, u, v, depthFactor, medianTolerance);
 		if (d > 0)
 		{
 			depth[i] = d;
@@ -218,6 +509,59 @@ static void ComputeStereoFromRGBD(const KeyPoints& keypoints, const KeyPoints& k
 	}
 }
 
+// Associate a "right" coordinate to a keypoint if there is valid depth in the depthmap.
+// The raw depthmap is only read at the keypoints, scaled by depthFactor.
+// Depthmaps other than CV_16U and CV_32F are converted to float first.
+static void ComputeStereoFromRGBD(const KeyPoints& keypoints, const KeyPoints& keypointsUn, const cv::Mat& depthImage,
+	float depthFactor, float medianTolerance, const CameraParams& camera, std::vector<float>& uright, std::vector<float>& depth,
+	cv::Mat& buffer)
+{
+	switch (depthImage.type())
+	{
+	case CV_16U:
+		ComputeStereoFromRGBD<ushort>(keypoints, keypointsUn, depthImage, depthFactor, medianTolerance, camera, uright, depth);
+		break;
+	case CV_32F:
+		ComputeStereoFromRGBD<float>(keypoints, keypointsUn, depthImage, depthFactor, medianTolerance, camera, uright, depth);
+		break;
+	default:
+		depthImage.convertTo(buffer, CV_32F);
+		ComputeStereoFromRGBD<float>(keypoints, keypointsUn, buffer, depthFactor, medianTolerance, camera, uright, depth);
+		break;
+	}
+}
+
+// Associate a "right" coordinate to a keypoint if there is a valid disparity in the disparity map.
+static void ComputeStereoFromDisparity(const KeyPoints& keypoints, const KeyPoints& keypointsUn, const cv::Mat& disparity,
+	const CameraParams& camera, std::vector<float>& uright, std::vector<float>& depth)
+{
+	CV_Assert(disparity.type() == CV_32F || disparity.type() == CV_16S);
+
+	const int nkeypoints = static_cast<int>(keypoints.size());
+
+	uright.assign(nkeypoints, -1.f);
+	depth.assign(nkeypoints, -1.f);
+
+	// Same limits as the stereo matching
+	const float maxd = camera.bf / camera.baseline;
+	const bool fixedPoint = disparity.type() == CV_16S;
+
+	for (int i = 0; i < nkeypoints; i++)
+	{
+		const cv::KeyPoint& keypoint = keypoints[i];
+		const cv::KeyPoint& keypointUn = keypointsUn[i];
+
+		const int v = static_cast<int>(keypoint.pt.y);
+		const int u = static_cast<int>(keypoint.pt.x);
+		const float d = fixedPoint ? disparity.at<short>(v, u) / 16.f : disparity.at<float>(v, u);
+		if (d > 0 && d < maxd)
+		{
+			depth[i] = camera.bf / d;
+			uright[i] = keypointUn.pt.x - d;
+		}
+	}
+}
+
 class ModeManager
 {
 public:
@@ -233,10 +577,7 @@ public:
 			localMapper_->RequestStop();
 
 			// Wait until Local Mapping has effectively stopped
-			while (!localMapper_->isStopped())
-			{
-				usleep(1000);
-			}
+			localMapper_->WaitUntilStopped();
 
 			tracker_->InformOnlyTracking(true);
 			activateLocalizationMode_ = false;
@@ -307,6 +648,131 @@ private:
 	bool reset_;
 };
 
+// Adapts the number of features and the FAST threshold of the extractors to the tracking quality.
+// While tracking keeps more than highInliers inliers for holdFrames frames, or while the extraction
+// is slower than targetTime without losing inliers, the budget is lowered step by step down to minFeatures.
+// It is raised as soon as the inliers drop below lowInliers, and restored when tracking is lost.
+// Between lowInliers and highInliers the budget is kept, so that it does not oscillate.
+class FeatureBudgetController
+{
+public:
+
+	FeatureBudgetController(const FeatureBudgetParams& param) : param_(param), nfeatures_(param.maxFeatures),
+		iniThFAST_(param.iniThFAST), holdCount_(0), avgTime_(0), frames_(0), lostFrames_(0), increases_(0),
+		decreases_(0), minUsed_(param.maxFeatures), sumFeatures_(0), sumInliers_(0), sumTime_(0) {}
+
+	// Updates the budget from the tracking result of a frame and the time spent extracting its features (ms)
+	void Update(int state, int inliers, double extractionTime)
+	{
+		// Telemetry, with the budget the frame was extracted with
+		frames_++;
+		minUsed_ = std::min(minUsed_, nfeatures_);
+		sumFeatures_ += nfeatures_;
+		sumInliers_ += inliers;
+		sumTime_ += extractionTime;
+		avgTime_ = frames_ == 1 ? extractionTime : 0.9 * avgTime_ + 0.1 * extractionTime;
+
+		const int step = std::max((param_.maxFeatures - param_.minFeatures) / 10, 1);
+		const bool slow = param_.targetTime > 0 && avgTime_ > param_.targetTime;
+
+		if (state != Tracking::STATE_OK)
+		{
+			lostFrames_++;
+			Set(param_.maxFeatures, param_.iniThFAST);
+			holdCount_ = 0;
+		}
+		else if (inliers < param_.lowInliers)
+		{
+			// Raise the budget quickly and accept weaker corners
+			Set(nfeatures_ + 2 * step, iniThFAST_ - 1);
+			holdCount_ = 0;
+		}
+		else if (inliers > param_.highInliers || slow)
+		{
+			// Lower the budget slowly, once tracking has been good for a while
+			if (++holdCount_ >= param_.holdFrames)
+			{
+				Set(nfeatures_ - step, iniThFAST_ + 1);
+				holdCount_ = 0;
+			}
+		}
+		else
+		{
+			holdCount_ = 0;
+		}
+	}
+
+	// Restores the full budget
+	void Reset()
+	{
+		Set(param_.maxFeatures, param_.iniThFAST);
+		holdCount_ = 0;
+	}
+
+	int GetNumFeatures() const { return nfeatures_; }
+	int GetIniThFAST() const { return iniThFAST_; }
+	int GetMinThFAST() const { return param_.minThFAST; }
+
+	void PrintTelemetry() const
+	{
+		if (frames_ == 0)
+			return;
+
+		std::cout << std::endl << "Feature Budget: " << std::endl;
+		std::cout << "- Frames: " << frames_ << " (not tracked: " << lostFrames_ << ")" << std::endl;
+		std::cout << "- Mean Number of Features: " << sumFeatures_ / frames_
+			<< " (min: " << minUsed_ << ", max: " << param_.maxFeatures << ")" << std::endl;
+		std::cout << "- Budget Changes: " << increases_ << " up, " << decreases_ << " down" << std::endl;
+		std::cout << "- Mean Tracking Inliers: " << sumInliers_ / frames_ << std::endl;
+		std::cout << "- Mean Extraction Time: " << sumTime_ / frames_ << " ms" << std::endl;
+	}
+
+private:
+
+	void Set(int nfeatures, int iniThFAST)
+	{
+		nfeatures = std::min(std::max(nfeatures, param_.minFeatures), param_.maxFeatures);
+		iniThFAST = std::min(std::max(iniThFAST, param_.minThFAST), param_.iniThFAST);
+
+		if (nfeatures > nfeatures_)
+			increases_++;
+		if (nfeatures < nfeatures_)
+			decreases_++;
+
+		nfeatures_ = nfeatures;
+		iniThFAST_ = iniThFAST;
+	}
+
+	FeatureBudgetParams param_;
+	int nfeatures_;
+	int iniThFAST_;
+	int holdCount_;
+	double avgTime_;
+
+	// Telemetry
+	int frames_;
+	int lostFrames_;
+	int increases_;
+	int decreases_;
+	int minUsed_;
+	double sumFeatures_;
+	double sumInliers_;
+	double sumTime_;
+};
+
+static double ElapsedMs(const std::chrono::steady_clock::time_point& t0)
+{
+	return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+}
+
+// Angle in radians of the rotation between two camera poses
+static double RotationAngle(const cv::Mat& T1, const cv::Mat& T2)
+{
+	const cv::Mat R = T1(cv::Rect(0, 0, 3, 3)).t() * T2(cv::Rect(0, 0, 3, 3));
+	const double cosAngle = 0.5 * (cv::trace(R)[0] - 1);
+	return std::acos(std::min(std::max(cosAngle, -1.), 1.));
+}
+
 class SystemImpl : public System
 {
 public:
@@ -362,6 +828,9 @@ public:
 		// Load color
 		RGB_ = static_cast<int>(settings["Camera.RGB"]) != 0;
 
+		// Load input format
+		inputFormat_ = ReadInputFormat(settings);
+
 		// Load ORB parameters
 		ORBextractor::Parameters extractorParams = ReadExtractorParams(settings);
 
@@ -370,20 +839,41 @@ public:
 		
 		// Load depth factor
 		depthFactor_ = sensor == System::RGBD ? ReadDepthFactor(settings) : 1.f;
+		depthMedianTolerance_ = sensor == System::RGBD ? ReadDepthMedianTolerance(settings) : 0.f;
+
+		// Load feature budget parameters
+		const FeatureBudgetParams budgetParams = ReadFeatureBudgetParams(settings, extractorParams);
+
+		// Load number of threads
+		const int nthreads = ReadNumThreads(settings, extractorParams, sensor);
 
 		// Print settings
-		PrintSettings(camera_, distCoeffs_, fps, RGB_, extractorParams, thDepth, sensor);
+		PrintSettings(camera_, distCoeffs_, fps, RGB_, inputFormat_, extractorParams, budgetParams, thDepth, sensor, nthreads);
+
+		// Create the thread pool shared by the extractors and the local mapping
+		threadPool_ = std::make_unique<ThreadPool>(nthreads);
 
 		// Initialize ORB extractors
-		extractorL_ = std::make_unique<ORBextractor>(extractorParams);
-		extractorR_ = std::make_unique<ORBextractor>(extractorParams);
+		thresholdMemory_ = extractorParams.thresholdMemory;
+		extractorL_ = std::make_unique<ORBextractor>(extractorParams, threadPool_.get());
+		extractorR_ = std::make_unique<ORBextractor>(extractorParams, threadPool_.get());
 
 		if (sensor == System::MONOCULAR)
 		{
 			extractorParams.nfeatures *= 2;
-			extractorIni_ = std::make_unique<ORBextractor>(extractorParams);
+			extractorIni_ = std::make_unique<ORBextractor>(extractorParams, threadPool_.get());
 		}
 
+		if (budgetParams.enabled)
+			featureBudget_ = std::make_unique<FeatureBudgetController>(budgetParams);
+
+		// Load detection masks
+		ReadExtractorMask(settings, "ORBextractor.mask", *extractorL_);
+		if (sensor == System::STEREO)
+			ReadExtractorMask(settings, "ORBextractor.maskRight", *extractorR_);
+		if (sensor == System::MONOCULAR)
+			ReadExtractorMask(settings, "ORBextractor.mask", *extractorIni_);
+
 		// Scale Level Info
 		GetScalePyramidInfo(*extractorL_, pyramid_);
 		
@@ -396,7 +886,7 @@ public:
 		tracker_ = Tracking::Create(this, &voc_, &map_, keyFrameDB_.get(), sensor_, trackParams);
 
 		//Initialize the Local Mapping thread and launch
-		localMapper_ = LocalMapping::Create(&map_, sensor_ == MONOCULAR, thDepth);
+		localMapper_ = LocalMapping::Create(&map_, sensor_ == MONOCULAR, thDepth, threadPool_.get());
 		threads_[THREAD_LOCAL_MAPPING] = std::thread(&ORB_SLAM2::LocalMapping::Run, localMapper_.get());
 
 		//Initialize the Loop Closing thread and launch
@@ -442,23 +932,99 @@ public:
 		resetManager_->Update();
 
 		// Color conversion
-		ConvertToGray(imageL, imageL_, RGB_);
-		ConvertToGray(imageR, imageR_, RGB_);
+		ConvertToGray(imageL, imageL_, RGB_, inputFormat_);
+		ConvertToGray(imageR, imageR_, RGB_, inputFormat_);
 
 		// ORB extraction
-		std::thread threadL([&]() { extractorL_->Extract(imageL_, keypointsL_, descriptorsL_); });
-		std::thread threadR([&]() { extractorR_->Extract(imageR_, keypointsR_, descriptorsR_); });
-		threadL.join();
-		threadR.join();
+		// The levels and cells of both images are processed by the same pool
+		const auto t0 = std::chrono::steady_clock::now();
+		threadPool_->ParallelFor(2, [&](int i)
+		{
+			if (i == 0)
+				extractorL_->Extract(imageL_, keypointsL_, descriptorsL_);
+			else
+				extractorR_->Extract(imageR_, keypointsR_, descriptorsR_);
+		});
+		const double extractionTime = ElapsedMs(t0);
+
+		// Stereo matching and undistortion are independent
+		UpdateUndistortionMap(imageL_.size());
+		threadPool_->ParallelFor(2, [&](int i)
+		{
+			if (i == 0)
+				stereoMatcher_.Compute(
+					keypointsL_, descriptorsL_, extractorL_->GetImagePyramid(),
+					keypointsR_, descriptorsR_, extractorR_->GetImagePyramid(),
+					pyramid_.scaleFactors, pyramid_.invScaleFactors, camera_, uright_, depth_, threadPool_.get());
+			else
+				UndistortKeyPoints(keypointsL_, keypointsUn_, camera_.Mat(), distCoeffs_, undistortionMap_, *threadPool_);
+		});
+
+		// Computes image bounds for the undistorted image
+		if (imageBounds_.Empty())
+			imageBounds_ = ComputeImageBounds(imageL_, camera_.Mat(), distCoeffs_);
+
+		// Create frame
+		currFrame_ = Frame(&voc_, timestamp, camera_, keypointsL_, keypointsUn_, uright_, depth_,
+			descriptorsL_, pyramid_, imageBounds_);
+
+		// Update tracker
+		const cv::Mat Tcw = tracker_->Update(currFrame_);
+
+		// Forget the FAST thresholds of the previous frames if the view has changed
+		UpdateThresholdMemory(Tcw);
+
+		// Adapt the feature budget
+		UpdateFeatureBudget(extractionTime);
+
+		if (viewer_)
+		{
+			viewer_->UpdateFrame(tracker_.get(), currFrame_, imageL_);
+			if (tracker_->GetState() == Tracking::STATE_OK)
+				viewer_->SetCurrentCameraPose(Tcw);
+		}
+
+		LOCK_MUTEX_STATE();
+		GetTracingResults(*tracker_, currFrame_, trackingState_, trackedMapPoints_, trackedKeyPointsUn_);
+
+		return Tcw;
+	}
+
+	// Proccess the given stereo frame with a disparity map computed upstream, registered to the left image.
+	// Input image: RGB (CV_8UC3) or grayscale (CV_8U). RGB is converted to grayscale.
+	// Input disparity: Float (CV_32F) in pixels, or fixed point (CV_16S) with 4 fractional bits.
+	// Returns the camera pose (empty if tracking fails).
+	cv::Mat TrackStereoDisparity(const cv::Mat& imageL, const cv::Mat& disparity, double timestamp) override
+	{
+		if (sensor_ != STEREO)
+		{
+			std::cerr << "ERROR: you called TrackStereoDisparity but input sensor was not set to STEREO." << std::endl;
+			std::exit(-1);
+		}
+
+		// Check mode change
+		modeManager_->Update();
+
+		// Check reset
+		resetManager_->Update();
+
+		// Color conversion
+		ConvertToGray(imageL, imageL_, RGB_, inputFormat_);
+
+		// The YUV formats are taller than the gray image, so the size is checked after the conversion
+		CV_Assert(disparity.size() == imageL_.size());
+
+		// ORB extraction (left image only)
+		const auto t0 = std::chrono::steady_clock::now();
+		extractorL_->Extract(imageL_, keypointsL_, descriptorsL_);
+		const double extractionTime = ElapsedMs(t0);
 
 		// Undistortion
-		UndistortKeyPoints(keypointsL_, keypointsUn_, camera_.Mat(), distCoeffs_);
+		UpdateUndistortionMap(imageL_.size());
+		UndistortKeyPoints(keypointsL_, keypointsUn_, camera_.Mat(), distCoeffs_, undistortionMap_, *threadPool_);
 
-		// Stereo matching
-		ComputeStereoMatches(
-			keypointsL_, descriptorsL_, extractorL_->GetImagePyramid(),
-			keypointsR_, descriptorsR_, extractorR_->GetImagePyramid(),
-			pyramid_.scaleFactors, pyramid_.invScaleFactors, camera_, uright_, depth_);
+		// Associate a "right" coordinate to a keypoint if there is valid disparity in the disparity map.
+		ComputeStereoFromDisparity(keypointsL_, keypointsUn_, disparity, camera_, uright_, depth_);
 
 		// Computes image bounds for the undistorted image
 		if (imageBounds_.Empty())
@@ -471,6 +1037,12 @@ public:
 		// Update tracker
 		const cv::Mat Tcw = tracker_->Update(currFrame_);
 
+		// Forget the FAST thresholds of the previous frames if the view has changed
+		UpdateThresholdMemory(Tcw);
+
+		// Adapt the feature budget
+		UpdateFeatureBudget(extractionTime);
+
 		if (viewer_)
 		{
 			viewer_->UpdateFrame(tracker_.get(), currFrame_, imageL_);
@@ -486,7 +1058,7 @@ public:
 
 	// Process the given rgbd frame. Depthmap must be registered to the RGB frame.
 	// Input image: RGB (CV_8UC3) or grayscale (CV_8U). RGB is converted to grayscale.
-	// Input depthmap: Float (CV_32F).
+	// Input depthmap: raw (CV_16U) or Float (CV_32F), scaled by DepthMapFactor.
 	// Returns the camera pose (empty if tracking fails).
 	cv::Mat TrackRGBD(const cv::Mat& image, const cv::Mat& depth, double timestamp) override
 	{
@@ -503,17 +1075,22 @@ public:
 		resetManager_->Update();
 
 		// Color conversion
-		ConvertToGray(image, imageL_, RGB_);
+		ConvertToGray(image, imageL_, RGB_, inputFormat_);
 
 		// ORB extraction
+		const auto t0 = std::chrono::steady_clock::now();
 		extractorL_->Extract(imageL_, keypointsL_, descriptorsL_);
+		const double extractionTime = ElapsedMs(t0);
 
 		// Undistortion
-		UndistortKeyPoints(keypointsL_, keypointsUn_, camera_.Mat(), distCoeffs_);
+		UpdateUndistortionMap(imageL_.size());
+		UndistortKeyPoints(keypointsL_, keypointsUn_, camera_.Mat(), distCoeffs_, undistortionMap_, *threadPool_);
 
 		// Associate a "right" coordinate to a keypoint if there is valid depth in the depthmap.
-		depth.convertTo(depthMap_, CV_32F, depthFactor_);
-		ComputeStereoFromRGBD(keypointsL_, keypointsUn_, depthMap_, camera_, uright_, depth_);
+		// The depthmap is sampled at the keypoints only, without converting it to float
+		CV_Assert(depth.size() == imageL_.size());
+		ComputeStereoFromRGBD(keypointsL_, keypointsUn_, depth, depthFactor_, depthMedianTolerance_, camera_,
+			uright_, depth_, depthMap_);
 
 		// Computes image bounds for the undistorted image
 		if (imageBounds_.Empty())
@@ -526,6 +1103,12 @@ public:
 		// Update tracker
 		const cv::Mat Tcw = tracker_->Update(currFrame_);
 
+		// Forget the FAST thresholds of the previous frames if the view has changed
+		UpdateThresholdMemory(Tcw);
+
+		// Adapt the feature budget
+		UpdateFeatureBudget(extractionTime);
+
 		if (viewer_)
 		{
 			viewer_->UpdateFrame(tracker_.get(), currFrame_, imageL_);
@@ -557,17 +1140,20 @@ public:
 		resetManager_->Update();
 
 		// Color conversion
-		ConvertToGray(image, imageL_, RGB_);
+		ConvertToGray(image, imageL_, RGB_, inputFormat_);
 
 		const int state = tracker_->GetState();
 		const bool init = state == Tracking::STATE_NOT_INITIALIZED || state == Tracking::STATE_NO_IMAGES;
 		auto& extractor = init ? extractorIni_ : extractorL_;
 
 		// ORB extraction
+		const auto t0 = std::chrono::steady_clock::now();
 		extractor->Extract(imageL_, keypointsL_, descriptorsL_);
+		const double extractionTime = ElapsedMs(t0);
 
 		// Undistortion
-		UndistortKeyPoints(keypointsL_, keypointsUn_, camera_.Mat(), distCoeffs_);
+		UpdateUndistortionMap(imageL_.size());
+		UndistortKeyPoints(keypointsL_, keypointsUn_, camera_.Mat(), distCoeffs_, undistortionMap_, *threadPool_);
 
 		// Create frame
 		currFrame_ = Frame(&voc_, timestamp, camera_, keypointsL_, keypointsUn_, descriptorsL_, pyramid_, imageBounds_);
@@ -575,6 +1161,13 @@ public:
 		// Update tracker
 		const cv::Mat Tcw = tracker_->Update(currFrame_);
 
+		// Forget the FAST thresholds of the previous frames if the view has changed
+		UpdateThresholdMemory(Tcw);
+
+		// Adapt the feature budget (the initializer keeps its own)
+		if (!init)
+			UpdateFeatureBudget(extractionTime);
+
 		if (viewer_)
 		{
 			viewer_->UpdateFrame(tracker_.get(), currFrame_, imageL_);
@@ -588,6 +1181,11 @@ public:
 		return Tcw;
 	}
 
+	void SetInputFormat(InputFormat format) override
+	{
+		inputFormat_ = format;
+	}
+
 	// This stops local mapping thread (map building) and performs only camera tracking.
 	void ActivateLocalizationMode() override
 	{
@@ -634,6 +1232,16 @@ public:
 		// Reset Tracking
 		tracker_->Reset();
 
+		// Restore the feature budget
+		if (featureBudget_)
+		{
+			featureBudget_->Reset();
+			ApplyFeatureBudget();
+		}
+
+		// Forget the FAST thresholds
+		ResetThresholdMemory();
+
 		// Reset Local Mapping
 		std::cout << "Reseting Local Mapper...";
 		localMapper_->RequestReset();
@@ -681,6 +1289,9 @@ public:
 
 		for (auto& t : threads_)
 			if (t.joinable()) t.join();
+
+		if (featureBudget_)
+			featureBudget_->PrintTelemetry();
 	}
 
 	// Save camera trajectory in the TUM RGB-D dataset format.
@@ -872,10 +1483,64 @@ public:
 		camera_ = ReadCameraParams(settings);
 		distCoeffs_ = ReadDistCoeffs(settings);
 		imageBounds_ = ImageBounds();
+
+		// Rebuild the undistortion map
+		undistortionMap_.Clear();
+		if (!imageL_.empty())
+			UpdateUndistortionMap(imageL_.size());
 	}
 
 private:
 
+	// Builds the undistortion map on the first frame of each image size
+	void UpdateUndistortionMap(const cv::Size& imageSize)
+	{
+		if (distCoeffs_(0) != 0.f && undistortionMap_.GetImageSize() != imageSize)
+			undistortionMap_.Create(imageSize, camera_.Mat(), distCoeffs_);
+	}
+
+	// Adapts the feature budget to the last tracked frame
+	void UpdateFeatureBudget(double extractionTime)
+	{
+		if (!featureBudget_)
+			return;
+
+		featureBudget_->Update(tracker_->GetState(), tracker_->GetMatchesInliers(), extractionTime);
+		ApplyFeatureBudget();
+	}
+
+	// Forgets the FAST thresholds remembered by the extractors when tracking is lost
+	// or the camera has rotated too much since the last frame to keep the same cells in view
+	void UpdateThresholdMemory(const cv::Mat& Tcw)
+	{
+		if (!thresholdMemory_)
+			return;
+
+		const double MAX_ROTATION = 5 * CV_PI / 180;
+		const bool tracked = tracker_->GetState() == Tracking::STATE_OK && !Tcw.empty();
+		if (!tracked || (!lastTcw_.empty() && RotationAngle(lastTcw_, Tcw) > MAX_ROTATION))
+			ResetThresholdMemory();
+
+		lastTcw_ = tracked ? Tcw.clone() : cv::Mat();
+	}
+
+	void ResetThresholdMemory()
+	{
+		for (ORBextractor* extractor : { extractorL_.get(), extractorR_.get(), extractorIni_.get() })
+			if (extractor)
+				extractor->ResetThresholdMemory();
+		lastTcw_ = cv::Mat();
+	}
+
+	void ApplyFeatureBudget()
+	{
+		for (ORBextractor* extractor : { extractorL_.get(), extractorR_.get() })
+		{
+			extractor->SetNumFeatures(featureBudget_->GetNumFeatures());
+			extractor->SetFASTThresholds(featureBudget_->GetIniThFAST(), featureBudget_->GetMinThFAST());
+		}
+	}
+
 	// Input sensor
 	Sensor sensor_;
 
@@ -888,6 +1553,10 @@ private:
 	// Map structure that stores the pointers to all KeyFrames and MapPoints.
 	Map map_;
 
+	// Threads shared by the extractors, the stereo matching, the undistortion and the local mapping
+	// (declared before its users, which use it until they are destroyed)
+	std::unique_ptr<ThreadPool> threadPool_;
+
 	// Tracker. It receives a frame and computes the associated camera pose.
 	// It also decides when to insert a new keyframe, create some new MapPoints and
 	// performs relocalization if tracking fails.
@@ -936,6 +1605,16 @@ private:
 	std::unique_ptr<ORBextractor> extractorR_;
 	std::unique_ptr<ORBextractor> extractorIni_;
 
+	// Stereo matching
+	StereoMatcher stereoMatcher_;
+
+	// Adaptive feature budget (null if disabled)
+	std::unique_ptr<FeatureBudgetController> featureBudget_;
+
+	// FAST threshold memory of the extractors and the pose it was built at
+	bool thresholdMemory_;
+	cv::Mat lastTcw_;
+
 	// Scale Level Info
 	ScalePyramidInfo pyramid_;
 
@@ -943,11 +1622,20 @@ private:
 	CameraParams camera_;
 	cv::Mat1f distCoeffs_;
 
+	// Precomputed undistortion (empty if there is no distortion)
+	UndistortionMap undistortionMap_;
+
 	// For RGB-D inputs only. For some datasets (e.g. TUM) the depthmap values are scaled.
 	float depthFactor_;
 
+	// For RGB-D inputs only. Rejects the depths that differ from their neighborhood (0 if disabled).
+	float depthMedianTolerance_;
+
 	// Color order (true RGB, false BGR, ignored if grayscale)
 	bool RGB_;
+
+	// Layout of the input images
+	InputFormat inputFormat_;
 };
 
 System::Pointer System::Create(const Path& vocabularyFile, const Path& settingsFile, Sensor sensor, bool useViewer)
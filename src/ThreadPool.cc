@@ -0,0 +1,179 @@
+/**
+* This file is part of ORB-SLAM2.
+*
+* Copyright (C) 2014-2016 RaYl Mur-Artal <raulmur at unizar dot es> (University of Zaragoza)
+* For more information see <https://github.com/raulmur/ORB_SLAM2>
+*
+* ORB-SLAM2 is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* ORB-SLAM2 is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with ORB-SLAM2. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "ThreadPool.h"
+
+#include <atomic>
+#include <algorithm>
+#include <exception>
+
+namespace ORB_SLAM2
+{
+
+// A ParallelFor call. Indices are claimed one by one by any thread that works on the task.
+struct ThreadPool::Task
+{
+	Task(int n, const std::function<void(int)>& func, Priority priority)
+		: n(n), next(0), done(0), func(func), priority(priority) {}
+
+	// Runs indices until none is left to claim
+	void Work()
+	{
+		while (WorkOne());
+	}
+
+	// Runs the next index, returns false if none was left to claim
+	bool WorkOne()
+	{
+		const int i = next++;
+		if (i >= n)
+			return false;
+
+		try
+		{
+			func(i);
+		}
+		catch (...)
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			if (!error)
+				error = std::current_exception();
+		}
+
+		if (++done == n)
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			finished.notify_all();
+		}
+		return true;
+	}
+
+	bool Exhausted() const
+	{
+		return next >= n;
+	}
+
+	void Wait()
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		finished.wait(lock, [this]() { return done >= n; });
+	}
+
+	const int n;
+	std::atomic<int> next;
+	std::atomic<int> done;
+	const std::function<void(int)>& func;
+	const Priority priority;
+	std::mutex mutex;
+	std::condition_variable finished;
+	std::exception_ptr error;
+};
+
+ThreadPool::ThreadPool(int nthreads) : stop_(false)
+{
+	for (int i = 1; i < nthreads; i++)
+		workers_.emplace_back(&ThreadPool::WorkerLoop, this);
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::unique_lock<std::mutex> lock(mutexTasks_);
+		stop_ = true;
+	}
+	newTask_.notify_all();
+
+	for (std::thread& worker : workers_)
+		worker.join();
+}
+
+int ThreadPool::NumThreads() const
+{
+	return static_cast<int>(workers_.size()) + 1;
+}
+
+void ThreadPool::ParallelFor(int n, const std::function<void(int)>& func, Priority priority)
+{
+	if (n <= 0)
+		return;
+
+	if (workers_.empty() || n == 1)
+	{
+		for (int i = 0; i < n; i++)
+			func(i);
+		return;
+	}
+
+	auto task = std::make_shared<Task>(n, func, priority);
+	{
+		// The high priority tasks go before the low priority ones, each in order of arrival
+		std::unique_lock<std::mutex> lock(mutexTasks_);
+		auto position = std::end(tasks_);
+		if (priority == PRIORITY_HIGH)
+			position = std::find_if(std::begin(tasks_), std::end(tasks_),
+				[](const std::shared_ptr<Task>& t) { return t->priority == PRIORITY_LOW; });
+		tasks_.insert(position, task);
+	}
+	newTask_.notify_all();
+
+	// Work on our own task, then wait for the indices claimed by the workers
+	task->Work();
+	task->Wait();
+
+	if (task->error)
+		std::rethrow_exception(task->error);
+}
+
+void ThreadPool::WorkerLoop()
+{
+	for (;;)
+	{
+		std::shared_ptr<Task> task;
+		{
+			std::unique_lock<std::mutex> lock(mutexTasks_);
+			newTask_.wait(lock, [this]() { return stop_ || !tasks_.empty(); });
+			if (stop_)
+				return;
+
+			// Take the first task with indices left to claim.
+			// In the others, the remaining work belongs to the threads that claimed it.
+			for (auto it = std::begin(tasks_); it != std::end(tasks_); )
+			{
+				if ((*it)->Exhausted())
+				{
+					it = tasks_.erase(it);
+					continue;
+				}
+				task = *it;
+				break;
+			}
+			if (!task)
+				continue;
+		}
+
+		// Back to the queue after each index of a low priority task, in case high priority work arrived
+		if (task->priority == PRIORITY_LOW)
+			task->WorkOne();
+		else
+			task->Work();
+	}
+}
+
+} // namespace ORB_SLAM2
@@ -182,6 +182,9 @@ struct LocalMap
 	std::vector<KeyFrame*> keyframes;
 	std::vector<MapPoint*> mappoints;
 	Map* map_;
+
+	// Keeps its buffers between frames
+	ProjectionMatcher projectionMatcher;
 };
 
 static int DiscardOutliers(Frame& currFrame)
@@ -604,7 +607,7 @@ static bool IsInFrustum(const Frame& frame, const CameraProjection& proj, MapPoi
 	return true;
 }
 
-static void SearchLocalPoints(const LocalMap& localMap, Frame& currFrame, float th)
+static void SearchLocalPoints(LocalMap& localMap, Frame& currFrame, float th)
 {
 	// Do not search map points already matched
 	for (MapPoint* mappoint : currFrame.mappoints)
@@ -642,10 +645,7 @@ static void SearchLocalPoints(const LocalMap& localMap, Frame& currFrame, float
 	}
 
 	if (nToMatch > 0)
-	{
-		ORBmatcher matcher(0.8f);
-		matcher.SearchByProjection(currFrame, localMap.mappoints, th);
-	}
+		localMap.projectionMatcher.Search(currFrame, localMap.mappoints, th, 0.8f);
 }
 
 static int TrackLocalMap(LocalMap& localMap, Frame& currFrame, float th, bool localization, bool stereo)
@@ -1217,6 +1217,7 @@ public:
 
 		// System is initialized. Track Frame.
 		bool success = false;
+		matchesInliers_ = 0;
 
 		// Initial camera pose estimation using motion model or relocalization (if tracking is lost)
 		if (state_ != STATE_OK)
@@ -1378,6 +1379,11 @@ public:
 		return lastProcessedState_;
 	}
 
+	int GetMatchesInliers() const override
+	{
+		return matchesInliers_;
+	}
+
 	const Frame& GetInitialFrame() const override
 	{
 		return initFrame_;